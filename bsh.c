@@ -3,6 +3,7 @@
  * 
  * Marcus Ribeiro
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
@@ -12,84 +13,683 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <termios.h>
+#include <spawn.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* Misc constants */
 #define MAXLINE    1024   /* max command line size */
-#define MAXARGS     128   /* max args on a command line */
-#define MAXJOBS      16   /* max jobs at any point in time */
-#define MAXJID    1<<16   /* max job ID */
+#define JOBS_INIT    16   /* initial job table size (grows as needed) */
+#define CMDTAB_INIT  64   /* initial command hash table size (power of 2) */
+#define ENVTAB_INIT  64   /* initial environment hash table size (power of 2) */
+#define DEFAULT_PATH "/bin:/usr/bin" /* search path when PATH is unset */
+#define INPUT_BUFSIZE 65536 /* initial command input buffer size */
+#define HISTORY_FILE ".bsh_history" /* in $HOME, unless $BSH_HISTORY */
+#define HISTORY_FLUSH 4096 /* history bytes buffered before a write */
+#define TRIE_DIRS    63   /* PATH directories completion covers */
+#define TRIE_BUILTIN (1ULL << TRIE_DIRS) /* trienode_t.dirs bit */
+#define COMPLETE_LIST 200 /* most completions listed on a double tab */
+#define OUT_RING   65536  /* bytes of output held before a write */
+#define OUT_SLACK  4096   /* of them, kept for signal handlers */
+#define EVLOG_RING (1 << 20) /* bytes of -L event records held */
+#define EVENT_BATCH  64   /* max events taken per epoll_wait */
+#define TIMEOUT_GRACE 2   /* secs from a timeout's SIGTERM to its SIGKILL */
+#define DONE_HISTORY 16   /* finished jobs remembered for jobs -l */
+#define BUILTIN_SLOTS 64  /* size of the builtin table (power of two) */
+#define BI_STAGE   1      /* builtin flag: may run as a pipeline stage */
+#define STR_CHUNK  65536  /* command-line blocks are carved from these */
+#define STR_MINCLASS 4    /* smallest block: 16 bytes */
+#define STR_NCLASSES 48   /* block sizes 2^0 .. 2^47 */
+#define HIST_SUBBITS 2    /* log2 of the sub-buckets per power of two */
+#define HIST_SUB     (1 << HIST_SUBBITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+/* Phases of running a command, each with a latency histogram */
+#define PH_PARSE   0      /* tokenizing the command line */
+#define PH_LOOKUP  1      /* command path lookup */
+#define PH_FORK    2      /* fork, until it returns in the shell */
+#define PH_SETPGID 3      /* the shell's setpgid on a forked child */
+#define PH_EXEC    4      /* start of the launch until the child exec'd */
+#define PH_ADDJOB  5      /* adding the job to the job list */
+#define PH_WAITFG  6      /* waiting for a foreground job */
+#define NPHASES    7
+
+/* Operators, as indexes into tok_ops */
+#define OP_PIPE    0  /* | */
+#define OP_IN      1  /* < file */
+#define OP_OUT     2  /* > file */
+#define OP_APPEND  3  /* >> file */
+#define OP_ERR     4  /* 2> file */
+#define OP_ERRDUP  5  /* 2>&1 */
+#define OP_HEREDOC 6  /* <<WORD, then lines up to WORD */
+#define OP_HERESTR 7  /* <<< word */
+#define NOPS       8
+
+/* Event loop tags (epoll_event.data.u64) */
+#define EV_STDIN   0ULL          /* stdin is readable */
+#define EV_SIGNAL  1ULL          /* the signalfd is readable */
+#define EV_TOKEN   2ULL          /* a jobserver token may be free */
+#define EV_PIDTAG  (1ULL << 32)  /* EV_PIDTAG | pid: that pid's pidfd */
 
 /* Job state constants */
 #define UNDEF 0 /* undefined (not an active job) */
 #define FG 1    /* running in foreground */
 #define BG 2    /* running in background */
 #define ST 3    /* stopped */
-
-/* The job struct */
+#define QU 4    /* queued: waiting to start in the background */
+#define WA 5    /* waiting for the jobs it runs after */
+
+/* Why the shell is waiting for a job to finish (job_t.awaited) */
+#define AW_WAIT  1  /* the wait builtin, or after in the foreground */
+#define AW_AFTER 2  /* a background after job depends on it */
+
+/* Jobserver tokens a job can hold, besides a token byte 0..255 */
+#define TOKEN_NONE     -1   /* none: no jobserver, or not a & job */
+#define TOKEN_INTR     -2   /* js_acquire: ctrl-c while waiting */
+#define TOKEN_BUSY     -3   /* js_try: every token is in use */
+#define TOKEN_IMPLICIT 256  /* the one token the shell holds by default */
+
+/* Launch paths */
+#define LAUNCH_SPAWN 0  /* posix_spawn: vfork-style, no page-table copy */
+#define LAUNCH_FORK  1  /* classic fork + execve */
+
+/* Parallel batch item states */
+#define PI_WAITING 0  /* not started yet */
+#define PI_RUNNING 1  /* process running (or stopped) */
+#define PI_DONE    2  /* reaped, or could not be started */
+
+/* Pipeline stage states */
+#define SG_RUNNING 0  /* process running */
+#define SG_STOPPED 1  /* process stopped */
+#define SG_DONE    2  /* reaped, or a builtin that has returned */
+
+/* One argument line of a parallel batch */
+typedef struct pitem_t {
+    char* line;             /* the item text (argv strings point into it) */
+    char** argv;            /* the command's argument vector for the item */
+    pid_t pid;              /* process running the item, 0 if none yet */
+    int state;              /* PI_WAITING, PI_RUNNING or PI_DONE */
+    int status;             /* wait status once PI_DONE */
+    int outfd;              /* -k: memfd holding the item's output, or -1 */
+    short token;            /* jobserver token held, or TOKEN_NONE */
+} pitem_t;
+
+/* A parallel batch, run as a single job */
+typedef struct batch_t {
+    pitem_t* items;
+    int nitems;
+    int next;               /* next item to start */
+    int maxrun;             /* most processes running at once (-j) */
+    int keep_order;         /* -k: output in input order */
+    int emitted;            /* -k: items whose output has been written */
+    volatile sig_atomic_t cancelled; /* ctrl-c: start nothing more */
+    volatile sig_atomic_t finished;  /* nothing running or left to run */
+    volatile sig_atomic_t refill;    /* items to start from the main line */
+    int jid;                /* its job */
+    char* path;             /* resolved command */
+    char** args;            /* the command and its fixed arguments */
+    struct batch_t* next_batch; /* list of batches not yet reclaimed */
+} batch_t;
+
+/* One stage of a pipeline job */
+typedef struct stage_t {
+    pid_t pid;              /* 0 for a builtin, or a command not started */
+    int state;              /* SG_RUNNING, SG_STOPPED or SG_DONE */
+    int status;             /* wait status once SG_DONE */
+} stage_t;
+
+/* Resource usage of a job, summed over its finished processes */
+typedef struct jobusage_t {
+    long long start_ns;     /* CLOCK_MONOTONIC time the job started */
+    long long end_ns;       /* when its last process was reaped, or 0 */
+    long long utime_us;     /* user CPU time */
+    long long stime_us;     /* system CPU time */
+    long maxrss_kb;         /* largest maximum resident set size */
+    long nvcsw;             /* voluntary context switches */
+    long nivcsw;            /* involuntary context switches */
+} jobusage_t;
+
+/* The redirections of one command, by the fd they replace */
+typedef struct redir_t {
+    char* path[3];          /* file for fd 0, 1 or 2, or NULL */
+    int flags[3];           /* open flags for it */
+    int errdup;             /* 2>&1: fd 2 goes wherever fd 1 does */
+    char* here;             /* <<< word: the word, for stdin */
+    int herefd;             /* <<WORD: its memfd, for stdin, or -1 */
+} redir_t;
+
+/* The here-documents of a command line, read before it runs */
+typedef struct heredocs_t {
+    int* fds;               /* sealed memfd of each, in line order */
+    int n;
+    int cap;
+    int next;               /* next one for take_redirs to claim */
+} heredocs_t;
+
+/* Storage a command line is tokenized into, owned by the caller and
+ * reused from line to line */
+typedef struct arena_t {
+    char* buf;              /* the words, NUL-terminated, back to back */
+    size_t cap;
+    char** argv;            /* pointers into buf, then NULL */
+    size_t argcap;
+} arena_t;
+
+/* The job struct, kept small since job-table scans walk every slot;
+ * the command line and resource usage are stored out of line */
 typedef struct job_t {
     pid_t pid;              /* process ID of starting process in the job */
+    pid_t pgid;             /* process group of the job's processes */
     int jid;                /* job ID [1, 2, ...] */
     int state;              /* current job state: UNDEF, BG, FG, or ST */
-    char cmdline[MAXLINE];  /* command line that launched the job */
+    int nprocs;             /* processes not yet reaped */
+    int pidfd;              /* pidfd watched by the event loop, or -1 */
+    char holed;             /* jid is on the table's hole stack */
+    char timed;             /* run by the time builtin: report at the end */
+    char reported;          /* a stage's death by signal was reported */
+    char killed;            /* timeout sent SIGTERM; SIGKILL comes next */
+    char awaited;           /* AW_WAIT, AW_AFTER: tell when it finishes */
+    short token;            /* jobserver token held, or TOKEN_NONE */
+    long long deadline;     /* when the watchdog signals it next, 0 if
+                               never; while queued, the timeout itself */
+    int nstages;            /* stages in a pipeline job, else 0 */
+    stage_t* stages;        /* pipeline stages, from the block arena; the
+                               pidmap proc of each process is its index */
+    batch_t* batch;         /* parallel batch the job runs, or NULL */
+    char* cmdline;          /* command line that launched the job, from
+                               the string arena; NULL for a free slot */
 } job_t;
 
+/* A builtin command */
+typedef struct builtin_t {
+    const char* name;
+    int (*fn)(char** argv, FILE* out); /* returns the exit status */
+    int flags;              /* BI_STAGE */
+} builtin_t;
+
+/* A finished job, as remembered for jobs -l */
+typedef struct done_t {
+    int jid;
+    pid_t pid;
+    int status;             /* wait status of its last process */
+    jobusage_t usage;
+    char* cmdline;          /* the job's, handed over from the arena */
+} done_t;
+
+/* The block arena job command lines and stages are kept in */
+typedef struct strarena_t {
+    char* chunk;            /* unused part of the current chunk */
+    size_t left;            /* bytes left in it */
+    char* free[STR_NCLASSES]; /* freed blocks of each size, linked
+                               through their first bytes */
+    size_t bytes;           /* bytes in blocks in use */
+} strarena_t;
+
+/* A latency histogram */
+typedef struct hist_t {
+    unsigned long count;
+    long long sum_ns;
+    long long max_ns;
+    unsigned long buckets[HIST_BUCKETS];
+} hist_t;
+
+/* A pid index entry */
+typedef struct pident_t {
+    pid_t pid;              /* 0 if the bucket is empty */
+    int jid;                /* job the process belongs to */
+    int proc;               /* which of the job's processes it is */
+} pident_t;
+
+/* The job list */
+typedef struct joblist_t {
+    job_t* slots;           /* slots[jid-1] holds job jid; UNDEF if free */
+    jobusage_t* usage;      /* usage[jid-1]: job jid's resource usage */
+    int cap;                /* number of slots allocated */
+    int maxjid;             /* largest allocated job ID, 0 if none */
+    int fgjid;              /* cached foreground job ID, 0 if none */
+    int nbg;                /* jobs in state BG */
+    int* holes;             /* freed job IDs below maxjid, for reuse */
+    int nholes;             /* number of entries on the hole stack */
+    pident_t* pidmap;       /* open-addressed index of live pids */
+    int pidcap;             /* pidmap size (power of two) */
+    int npids;              /* pids in the index, at most pidcap / 2 */
+} joblist_t;
+
+/* A background command waiting for admission, with its arguments,
+ * in one block from the arena */
+typedef struct queued_t {
+    int jid;                /* its job, in state QU or WA */
+    int fds[3];             /* its redirections, open until it starts */
+    int errdup;             /* 2>&1 */
+    size_t size;            /* size of the block */
+    char* path;             /* resolved command */
+    char** argv;
+    char** env;             /* its VAR=value words */
+    int nenv;
+    int* deps;              /* jobs to finish first (WA), 0 once done */
+    int ndeps;              /* how many of them are left */
+    struct queued_t* next;  /* FIFO order */
+} queued_t;
+
+/* The background admission queue */
+typedef struct runqueue_t {
+    int maxjobs;            /* most background jobs running, 0: no limit */
+    queued_t* head;
+    queued_t* tail;
+    int n;                  /* jobs held back: queued or waiting */
+    queued_t* waiting;      /* after jobs, until their jobs are done */
+    int starved;            /* the head waits for a jobserver token */
+} runqueue_t;
+
+/* The jobs named by the line's after prefix */
+typedef struct afterlist_t {
+    int* jids;
+    int n;
+    int cap;
+} afterlist_t;
+
+/* What the wait builtin is waiting for */
+typedef struct waitset_t {
+    int left;               /* jobs marked AW_WAIT not yet finished */
+    int any;                /* wait -n: the first to finish is enough */
+    int done;               /* jobs finished since the wait began */
+    int lastjid;            /* the job whose status is the wait's */
+    int status;             /* wait status of lastjid, or of the first */
+    int failed;             /* a job that did not succeed, or 0 */
+} waitset_t;
+
+/* A GNU make jobserver the shell takes tokens from */
+typedef struct jobserver_t {
+    int rfd;                /* nonblocking read end of the tokens, or -1 */
+    int wfd;                /* where tokens go back */
+    volatile sig_atomic_t implicit; /* the implicit token is free */
+    int own;                /* created by setopt jobserver N */
+    int size;               /* N, if own */
+} jobserver_t;
+
+/* A watchdog deadline: when job jid is due its next signal */
+typedef struct deadline_t {
+    long long at;           /* now_ns() clock */
+    int jid;
+} deadline_t;
+
+/* The watchdog: the deadlines of timeout jobs in a binary min-heap,
+ * with the one interval timer set for the earliest */
+typedef struct watchdog_t {
+    deadline_t* heap;       /* stale entries are skipped when they pop */
+    int n;
+    int cap;
+    int pending;            /* queued timeout jobs, each owed a slot */
+} watchdog_t;
+
+/* A cached command lookup */
+typedef struct cmdent_t {
+    char* name;             /* command name as typed */
+    char* path;             /* file to execute, or NULL if not on PATH */
+    unsigned int hash;      /* hash of name */
+    int hits;               /* number of times the entry was used */
+    struct cmdent_t* next;  /* next entry in the same bucket */
+} cmdent_t;
+
+/* A PATH directory, with the mtime it had when last searched */
+typedef struct pathdir_t {
+    char* dir;
+    struct timespec mtime;
+} pathdir_t;
+
+/* The command hash table */
+typedef struct cmdtab_t {
+    cmdent_t** buckets;     /* chained buckets */
+    int size;               /* number of buckets (power of two) */
+    int count;              /* number of entries */
+    char* pathvar;          /* PATH value the entries were found under */
+    pathdir_t* dirs;        /* pathvar split into directories */
+    int ndirs;
+} cmdtab_t;
+
+/* An environment variable */
+typedef struct envvar_t {
+    char* entry;            /* "NAME=value", as it goes in envp */
+    size_t namelen;
+    unsigned int hash;      /* hash of the name */
+    int slot;               /* its index in envtab.envp */
+    struct envvar_t* next;  /* next variable in the same bucket */
+} envvar_t;
+
+/* The environment: a hash table of the variables, and the envp array
+ * children get, kept up to date as they change */
+typedef struct envtab_t {
+    envvar_t** buckets;     /* chained buckets */
+    int size;               /* number of buckets (power of two) */
+    int count;              /* number of variables, and of envp entries */
+    char** envp;            /* count entries and a NULL */
+    int cap;                /* room in envp, overrides included */
+    int spare;              /* room kept past count for overrides */
+} envtab_t;
+
+/* Buffered command input */
+typedef struct input_t {
+    int fd;                 /* descriptor commands are read from */
+    char* buf;              /* buf[start, end) holds unread bytes */
+    size_t cap;
+    size_t start;
+    size_t end;
+    size_t maxline;         /* longest line returned in one piece */
+    long held;              /* offset overwritten by the last line's NUL */
+    char heldch;            /* byte that was there, or held < 0 */
+    int eof;                /* read() has returned 0 */
+    int mapped;             /* buf is an mmap of the whole input file */
+} input_t;
+
+/* A trigram index entry: the history entries a trigram occurs in */
+typedef struct trigram_t {
+    uint32_t key;           /* trikey(); 0 if the bucket is empty */
+    uint32_t n;
+    uint32_t cap;
+    uint32_t* ids;          /* entry numbers, ascending */
+} trigram_t;
+
+/* A node of the completion trie: one character of a command name,
+ * with its children linked first-child, next-sibling */
+typedef struct trienode_t {
+    int child;              /* -1 if none */
+    int sibling;            /* -1 if none */
+    int live;               /* names ending at or below this node */
+    char ch;
+    unsigned long long dirs; /* where the name ending here is: bit i for
+                               PATH directory i, TRIE_BUILTIN; 0 if none */
+} trienode_t;
+
+/* The completion trie of command names, with the PATH directories it
+ * was filled from and the mtimes they had then */
+typedef struct comptrie_t {
+    trienode_t* nodes;      /* nodes[0] is the root */
+    int n;
+    int cap;
+    char* pathvar;
+    pathdir_t* dirs;
+    int ndirs;
+} comptrie_t;
+
+/* The command history: the file as mapped at startup, then this
+ * session's lines, with a line index and a trigram index over both
+ * that are built when first needed */
+typedef struct history_t {
+    int fd;                 /* the history file, or -1 if none is kept */
+    char* map;              /* its contents at startup */
+    size_t maplen;
+    char* sess;             /* lines added since, each ending in '\n' */
+    size_t sesslen;
+    size_t sesscap;
+    size_t written;         /* bytes of sess in the file */
+    size_t* starts;         /* offset of each entry, in map then sess */
+    uint32_t nentries;      /* valid once starts is built */
+    uint32_t startcap;
+    trigram_t* tri;         /* open-addressed, power-of-two size */
+    uint32_t tricap;
+    uint32_t ntri;
+} history_t;
+
+/* Bytes not yet written to fd: a ring that both the main line and
+ * signal handlers add to, written out with writev */
+typedef struct ring_t {
+    char* buf;
+    size_t size;
+    int fd;                      /* where it is written, -1 for nowhere */
+    volatile unsigned long head; /* bytes ever added */
+    volatile unsigned long tail; /* bytes ever written */
+    volatile sig_atomic_t busy;  /* someone is adding or writing */
+    volatile unsigned long lost; /* records dropped for want of room */
+} ring_t;
+
 /* Global variables */
-job_t jobs[MAXJOBS];        /* The job list */
-int nextjid = 1;            /* next job ID to allocate */
+joblist_t jobs;             /* The job list */
+cmdtab_t cmdtab;            /* cached PATH lookups */
+envtab_t envtab;            /* the environment children are given */
 int verbose = 0;            /* whether to print verbose output */
+int launch_mode = LAUNCH_SPAWN; /* how eval starts child processes */
+volatile sig_atomic_t in_handler = 0; /* running inside a signal handler */
+volatile sig_atomic_t launch_pending = 0; /* launches left for the main line */
+int wake_pipe[2] = { -1, -1 }; /* a byte here wakes the main line for them */
+batch_t* batches = NULL;    /* parallel batches not yet reclaimed */
+done_t donelog[DONE_HISTORY]; /* ring of recently finished jobs */
+int ndone = 0;              /* jobs ever finished; ndone % DONE_HISTORY is next */
+hist_t stats[NPHASES];      /* latency of each phase, reset by stats */
+runqueue_t runq;            /* background jobs over setopt maxjobs */
+afterlist_t after;          /* jobs the line's command runs after */
+waitset_t waitset;          /* jobs the wait builtin is waiting for */
+jobserver_t js = { -1, -1, 1, 0, 0 }; /* make's, or our own */
+watchdog_t wd;              /* deadlines of jobs run under timeout */
+strarena_t strings;         /* where job command lines and stages are kept */
+volatile sig_atomic_t shell_interrupted; /* ctrl-c with no foreground job */
+int event_mode = 0;         /* using the signalfd/pidfd/epoll core (-e) */
+int epfd = -1;              /* event loop epoll instance */
+int sigfd = -1;             /* signalfd for SIGCHLD, SIGINT, SIGTSTP,
+                               SIGALRM */
+int stdin_watched = 0;      /* stdin interest: 1 on, 0 off, -1 not pollable */
+sigset_t child_sigmask;     /* signal mask children start with */
+input_t input;              /* where commands come from */
+history_t history = { -1 }; /* lines read, kept across sessions */
+int edit_mode = 0;          /* reading lines with the editor (setopt edit) */
+int edit_ok = 0;            /* stdin and stdout are a terminal */
+comptrie_t comptrie;        /* command names for tab completion */
+int batch_mode = 0;         /* running a script file (-f or file stdin) */
+long batch_lines = 0;       /* command lines run in batch mode */
+struct timespec batch_start; /* when batch mode started reading */
+pid_t shell_pid;            /* the shell itself, as opposed to children */
+char outbuf[OUT_RING];
+ring_t outring = { outbuf, OUT_RING, STDOUT_FILENO }; /* the shell's output,
+                               waiting to be written */
+ring_t evlog = { NULL, 0, -1 }; /* job event records for -L */
 char prompt[] = "bsh> ";    /* command line prompt */
-extern char** environ;      /* needed for execve */
+char tok_ops[NOPS][5] = {   /* the words tokenize gives operators, */
+  "|", "<", ">", ">>", "2>", "2>&1", "<<", "<<<" /* told from quoted */
+};                                                /* text by address */
+heredocs_t heredocs;        /* here-documents of the line being run */
+extern char** environ;      /* the environment the shell started with */
 
 /* Function prototypes */
 
 /* Core shell functions */
 void eval(char* cmdline);
-int parseline(const char* cmdline, char** argv); 
+void eval_pipeline(char*** stagev, int n, char* cmdline, int bg, int timed,
+                   long long limit);
+int tokenize(const char* cmdline, arena_t* arena, int* bg);
+int tokop(const char* word);
+int take_redirs(char** argv, redir_t* r);
+int open_redirs(redir_t* r, int fds[3]);
+void close_redirs(int fds[3]);
+int here_string(const char* word);
+int read_heredocs(char** argv);
+void close_heredocs(void);
+int redirect_stdout(int fd);
+void restore_stdout(int saved);
 int builtin_cmd(char** argv);
+void initbuiltins(void);
+const builtin_t* find_builtin(const char* name);
 void do_bgfg(char** argv);
 void waitfg(pid_t pid);
+pid_t launch(char* path, char** argv, char** env, int nenv, pid_t pgid,
+             int infd, int outfd, int errfd);
 
 /* Signal handlers */
 void sigchld_handler(int sig);
+void defer_launch(void);
+void block_jobsigs(sigset_t* prev);
+void run_deferred(void);
 void sigtstp_handler(int sig);
 void sigint_handler(int sig);
 void sigquit_handler(int sig);
+void sigalrm_handler(int sig);
+void reap_status(pid_t pid, int status, struct rusage* ru);
+
+/* Input and event loop functions */
+void initinput(input_t* in, int fd);
+int input_map(input_t* in);
+void input_wait(int fd);
+char* input_readline(input_t* in);
+void inithistory(int interactive);
+void history_add(const char* line);
+void history_flush(void);
+int do_history(char** argv, FILE* out);
+int do_compgen(char** argv, FILE* out);
+void initeditor(int interactive);
+char* edit_readline(void);
+void initevents(void);
+int watchexit(pid_t pid);
+int event_wait(int want_stdin, int timeout_ms);
 
 /* Job list helper functions */
 void clearjob(job_t* job);
-void initjobs(job_t* jobs);
-int maxjid(job_t* jobs); 
-int addjob(job_t* jobs, pid_t pid, int state, char* cmdline); //addjob(jobs,pid,FG,
-int deletejob(job_t* jobs, pid_t pid); 
-pid_t fgpid(job_t* jobs);
-job_t* getjobpid(job_t* jobs, pid_t pid);
-job_t* getjobjid(job_t* jobs, int jid); 
+void initjobs(joblist_t* jobs);
+int maxjid(joblist_t* jobs); 
+int addjob(joblist_t* jobs, pid_t pid, int state, char* cmdline); //addjob(jobs,pid,FG,
+job_t* takejob(joblist_t* jobs, int state, char* cmdline);
+void joinjob(joblist_t* jobs, job_t* job, pid_t pid, int proc, int state);
+int deletejob(joblist_t* jobs, pid_t pid); 
+int pidindex_reserve(joblist_t* jobs, int n);
+void attachpid(joblist_t* jobs, job_t* job, pid_t pid, int proc);
+job_t* detachpid(joblist_t* jobs, pid_t pid);
+void removejob(joblist_t* jobs, job_t* job);
+void* blockalloc(size_t size);
+void blockfree(void* block, size_t size);
+char* savestr(const char* s);
+void freestr(char* s);
+void setjobstate(joblist_t* jobs, job_t* job, int state);
+job_t* fgjob(joblist_t* jobs);
+pid_t fgpid(joblist_t* jobs);
+job_t* getjobpid(joblist_t* jobs, pid_t pid);
+job_t* getjobproc(joblist_t* jobs, pid_t pid, int* proc);
+job_t* getjobjid(joblist_t* jobs, int jid); 
 
 int pid2jid(pid_t pid); 
-void listjobs(job_t* jobs);
+void listjobs(joblist_t* jobs);
+
+/* Resource accounting functions */
+long long now_ns(void);
+void add_rusage(jobusage_t* u, struct rusage* ru);
+void finishjob(job_t* job, int status);
+void report_usage(jobusage_t* u);
+void listjobs_long(joblist_t* jobs);
+void time_builtin(char** argv);
+
+/* Latency statistics functions */
+void stat_record(int phase, long long start);
+void print_stats(void);
+void do_stats(void);
+
+/* Admission queue functions */
+int queue_full(void);
+int enqueue(char* path, char** argv, char** env, int nenv, int fds[3],
+            int errdup, char* cmdline, int timed, long long limit);
+void admit_queued(void);
+int start_queued(job_t* job, int state, int token);
+int run_queued(job_t* job, int state);
+void do_setopt(char** argv);
+
+/* Job dependency functions */
+int after_prefix(char** argv);
+int after_pending(void);
+void after_finished(job_t* job, int status);
+int wait_jobs(int* jids, int n, int any);
+int do_wait(char** argv);
+
+/* Jobserver functions */
+void initjobserver(void);
+int js_try(void);
+void js_watch(void);
+int js_acquire(const sigset_t* waitmask);
+void js_release(int token);
+int js_create(int n);
+
+/* Watchdog functions */
+double parse_interval(const char* s);
+long long parse_timeout(const char* s);
+int watchdog_reserve(int extra);
+void watchdog_arm(job_t* job, long long limit);
+
+/* Parallel batch functions */
+void do_parallel(char** argv);
+void batch_refill(job_t* job);
+void resume_batch(job_t* job);
+void batch_reaped(job_t* job, int proc, int status);
+void batch_poll(void);
+
+/* Command lookup functions */
+void initcmdtab(void);
+char* lookup_cmd(char* name);
+void forget_cmd(const char* name);
+void cmdtab_chdir(void);
+void do_hash(char** argv);
+
+/* Environment functions */
+void initenv(void);
+char* env_get(const char* name);
+int env_set(const char* name, const char* value);
+int env_assigns(char** argv);
+int env_reserve(int n);
+char** env_overlay(char** env, int n, char** saved);
+void env_restore(char** env, int n, char** saved);
+int do_export(char** argv);
+int do_unset(char** argv);
+
+/* Output functions */
+void initoutput(void);
+int ring_put(ring_t* r, const char* s, size_t n, size_t limit);
+void ring_flush(ring_t* r);
+void out_write(const char* s, size_t n);
+void out_flush(void);
+
+/* Job event log functions */
+void initevlog(const char* file);
+void evlog_job(const char* event, job_t* job, pid_t pid, const char* key,
+               int value);
+void evlog_idle(void);
 
 /* Other helper functions */
 void safe_printf(const char* format, ...);
+size_t sio_vformat(char* buf, size_t cap, const char* format, va_list args);
+size_t sio_format(char* buf, size_t cap, const char* format, ...);
+void relay(int from, int to);
 void error(char* msg);
 typedef void handler_t(int);
 handler_t* Signal(int signum, handler_t* handler);
 void print_usage();
+void shell_atexit(void);
 
 /*
  * main - The shell's main routine 
  */
 int main(int argc, char** argv) {
-  char cmdline[MAXLINE]; /* buffer to hold a line of input */
+  char* cmdline; /* the current line of input */
   int emit_prompt = 1; /* by default, print shell prompts */
+  int input_fd = STDIN_FILENO; /* where commands are read from */
 
   /* Necessary for the driver to receive all shell output */
   dup2(1, 2);
 
   /* Parse the command line */
   char c;
-  while ((c = getopt(argc, argv, "hvp")) != EOF) {
+  while ((c = getopt(argc, argv, "hvpFef:L:")) != EOF) {
     switch (c) {
       case 'h':             /* print help message */
         print_usage();
@@ -100,6 +700,21 @@ int main(int argc, char** argv) {
       case 'p':             /* don't print a prompt */
         emit_prompt = 0;  /* handy for automatic testing */
         break;
+      case 'F':             /* launch children with fork + execve */
+        launch_mode = LAUNCH_FORK;
+        break;
+      case 'e':             /* event-driven core */
+        event_mode = 1;
+        break;
+      case 'f':             /* run a script file in batch mode */
+        if ((input_fd = open(optarg, O_RDONLY | O_CLOEXEC)) < 0) {
+          error(optarg);
+        }
+        batch_mode = 1;
+        break;
+      case 'L':             /* log job events to a file */
+        initevlog(optarg);
+        break;
       default:
         print_usage();
         break;
@@ -112,36 +727,88 @@ int main(int argc, char** argv) {
   Signal(SIGTSTP, sigtstp_handler); /* ctrl-z */
   Signal(SIGCHLD, sigchld_handler); /* Terminated or stopped child */
   Signal(SIGQUIT, sigquit_handler); /* kill the shell on SIGQUIT */
+  Signal(SIGALRM, sigalrm_handler); /* a timeout job's deadline */
+
+  /* Children start with the mask the shell was started with */
+  sigprocmask(SIG_SETMASK, NULL, &child_sigmask);
+
+  /* With -e, the handlers are instead run from the event loop */
+  if (event_mode) {
+    initevents();
+  } else if (pipe2(wake_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+    error("pipe error");
+  }
 
-  /* Initialize the job list */
-  initjobs(jobs);
+  /* Initialize the output, the environment, the job list, the command
+   * hash table and the input */
+  initoutput();
+  initenv();
+  initjobs(&jobs);
+  initcmdtab();
+  initbuiltins();
+  initjobserver();
+  initinput(&input, input_fd);
+
+  /*
+   * Batch mode: a script file (-f, or a regular file on stdin) is
+   * mapped whole and its lines are handed to eval in place. Output is
+   * only written when the ring fills, before a child is launched and
+   * at exit, instead of after every line.
+   */
+  if (input_map(&input)) {
+    batch_mode = 1;
+    emit_prompt = 0;
+    clock_gettime(CLOCK_MONOTONIC, &batch_start);
+  } else if (batch_mode) {
+    batch_mode = 0; /* -f on something unmappable, e.g. a pipe */
+  }
+  if (!batch_mode) { /* scripts don't go into the history */
+    inithistory(isatty(input.fd));
+    initeditor(emit_prompt && input.fd == STDIN_FILENO);
+  }
+  shell_pid = getpid();
+  atexit(shell_atexit);
 
   /* Execute the shell's read/eval loop */
   while (1) {
 
+    /* start what the reap path made room for while the last ran */
+    run_deferred();
+
+    /* finish off parallel batches that completed in the background */
+    if (batches) {
+      batch_poll();
+    }
+
     /* print command prompt, if enabled */
     if (emit_prompt) {
       printf("%s", prompt);
-      fflush(stdout);
     }
 
-    /* Read command line from stdin (i.e., regular user input) */
-    if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin)) {
-      error("fgets error");
+    /* Write the last command's output and the prompt in one go */
+    if (!batch_mode) {
+      out_flush();
     }
+    evlog_idle();
+
+    /* Read command line from stdin (i.e., regular user input) */
+    cmdline = edit_mode ? edit_readline() : input_readline(&input);
 
     /* Typing ctrl-d indicates EOF (end-of-file); quit the shell */
-    if (feof(stdin)) {
-      fflush(stdout);
+    if (cmdline == NULL) {
       exit(0);
     }
 
+    if (history.fd >= 0) {
+      history_add(cmdline);
+    }
+
     /* Evaluate the command line */
     eval(cmdline);
 
-    /* Make sure all output has been printed before continuing */
-    fflush(stdout);
-    fflush(stdout);
+    if (batch_mode) { /* output is written when needed, not per line */
+      batch_lines++;
+    }
   } 
 
   exit(0); /* control should never reach here */
@@ -157,615 +824,6564 @@ int main(int argc, char** argv) {
 */
 void eval(char* cmdline) {
 
-  char* argv[MAXARGS];
+  static arena_t words; /* grows to the longest line, then is reused */
+  static char* line;    /* the line, kept while here-documents are read */
+  static size_t linecap;
+  int if_bg;
 
-  int if_bg = parseline(cmdline,argv);
+  close_heredocs();
+  after.n = 0;
 
-  if (!builtin_cmd(argv)) {
+  long long t0 = now_ns();
+  int argc = tokenize(cmdline, &words, &if_bg);
+  char** argv = words.argv;
+  int timed = 0;
+  long long limit = 0; /* timeout, in ns */
 
-	sigset_t mask;
- 	sigemptyset(&mask);
- 	sigaddset(&mask, SIGCHLD);
-
-	int pid_result;
+  stat_record(PH_PARSE, t0);
 
-	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) { // block SIGCHLD
+  if (argc <= 0) { //blank line, or a quote left open
 
-		error("sigprocmask is not blocking the sigchld in eval");
+	if (argc < 0) {
+		printf("Syntax error: unterminated quote\n");
 	}
+	return;
+  }
 
-	if ((pid_result = fork()) == 0) { //child
-
-		//run job
-		if (setpgid(0, 0) == -1) {
+  if (strstr(cmdline, "<<")) { //may have here-documents, read past the line
 
-			error("setpgid is not working in eval");
-		}
-		//unblock in child
-		if (sigprocmask(SIG_UNBLOCK, &mask, NULL) == -1){
+	size_t len = strlen(cmdline) + 1;
 
-			error("sigprocmask is not working in eval");
-		}
-		if ((argv[0][0] != '.') && (argv[0][0] != '/')) {
+	if (len > linecap && !(line = realloc(line, linecap = len))) {
 
-			char new_buf[MAXLINE];
-			char* path = "/bin/";
+		error("eval: out of memory");
+	}
+	cmdline = memcpy(line, cmdline, len);
+	read_heredocs(argv);
+  }
 
-			strcpy(new_buf, path);
-			strcat(new_buf, argv[0]);
+  while (argv[0]) { //time, timeout and after prefixes, in any order
 
-			argv[0] = new_buf;
-		}
+	int skip = 0;
 
-		if (execve(argv[0], argv, environ) < 0) {
+	if (!timed && !strcmp(argv[0], "time")) { //run the rest and report
 
-			printf("%s: Command not found.\n",argv[0]);
-			exit(0);
-		}
+		timed = 1;
+		skip = 1;
 	}
 
-	if ((!if_bg)) { //foreground
+	else if (!limit && !strcmp(argv[0], "timeout")) { //run the rest under a deadline
 
-		if (addjob(jobs, pid_result, FG, argv[1])) {
+		if (!argv[1] || !argv[2]) {
 
-			if (sigprocmask(SIG_UNBLOCK, &mask, NULL) == -1) { //unblock sigchild
+			printf("usage: timeout secs command\n");
+			return;
+		}
 
-				error("sigprocmask is not working in eval");
-			}
+		if (!(limit = parse_timeout(argv[1]))) {
 
-			waitfg(pid_result);
+			printf("timeout: invalid time interval '%s'\n", argv[1]);
+			return;
 		}
 
-		else {
-			if(kill(-pid_result,SIGINT) == -1) {
+		if (!watchdog_reserve(1)) {
 
-				error("problem with kill in eval");
-			}
+			printf("timeout: out of memory\n");
+			return;
 		}
+		skip = 2;
 	}
 
-	else {
-		if (addjob(jobs, pid_result, BG, cmdline)){
+	else if (!after.n && !strcmp(argv[0], "after")) { //run the rest once other jobs succeed
 
-			if (sigprocmask(SIG_UNBLOCK, &mask, NULL) == -1) { //unblock sigchild
+		if ((skip = after_prefix(argv)) < 0) {
 
-				error("sigprocmask is not working in eval");
-			}
+			return;
+		}
+	}
 
-			job_t* job = getjobpid(jobs,pid_result);
+	if (!skip) {
 
-			printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
-		}
+		break;
+	}
+
+	int i = 0;
+	do {
+		argv[i] = argv[i + skip];
+	} while (argv[i++]);
+
+	if (!argv[0]) {
+		return;
+	}
+  }
 
-		else {
+  //VAR=value words before the command go in its environment only, and
+  //on their own they set variables; a pipeline sorts out its stages'
+  char** env = argv;
+  int nenv = env_assigns(argv);
 
-			if(kill(-pid_result,SIGINT) == -1) {
+  argv += nenv;
+  if (!argv[0]) {
 
-				error("problem with kill in eval");
-			}
-		}
+	for (int i = 0; i < nenv; i++) {
+
+		char* eq = strchr(env[i], '=');
+		*eq = '\0';
+		env_set(env[i], eq + 1);
+		*eq = '=';
 	}
+	return;
   }
-  return;
-}
 
-/* 
- * parseline - Parse the command line and build the argv array.
- * 
- * Characters enclosed in single quotes are treated as a single
- * argument.  Return true if the user has requested a background
- * job or false if the user has requested a foreground job.  
- */
-int parseline(const char* cmdline, char** argv) {
-  static char array[MAXLINE]; /* holds local copy of command line */
-  char* buf = array;          /* ptr that traverses command line */
-  char* delim;                /* points to first space delimiter */
-  int argc;                   /* number of args */
-  int bg;                     /* background job? */
-
-  strcpy(buf, cmdline);
-  buf[strlen(buf) - 1] = ' ';  /* replace trailing '\n' with space */
-  while (*buf && (*buf == ' ')) { /* ignore leading spaces */
-    buf++;
-  }
-
-  /* Build the argv list */
-  argc = 0;
-  if (*buf == '\'') {
-    buf++;
-    delim = strchr(buf, '\'');
-  } else {
-    delim = strchr(buf, ' ');
+  int nwords = 0, nstages = 1;
+  for (; argv[nwords]; nwords++) {
+
+	nstages += tokop(argv[nwords]) == OP_PIPE;
   }
 
-  while (delim) {
-    argv[argc++] = buf;
-    *delim = '\0';
-    buf = delim + 1;
-    while (*buf && (*buf == ' ')) { /* ignore spaces */
-      buf++;
-    }
+  //only a simple external command waits for its jobs in the background
+  if (after.n && if_bg && nstages > 1) {
 
-    if (*buf == '\'') {
-      buf++;
-      delim = strchr(buf, '\'');
-    } else {
-      delim = strchr(buf, ' ');
-    }
+	printf("after: a background pipeline cannot wait for jobs\n");
+	return;
   }
-  argv[argc] = NULL;
 
-  if (argc == 0) {  /* ignore blank line */
-    return 1;
+  if (after.n && (!if_bg || (find_builtin(argv[0]) && !limit))) { //so wait here
+
+	int rc = wait_jobs(after.jids, after.n, 0);
+
+	if (waitset.failed) {
+
+		printf("after: [%d] failed\n", waitset.failed);
+		return;
+	}
+
+	if (rc == 127 || shell_interrupted) { //an unknown job (reported), or ctrl-c
+
+		return;
+	}
+	after.n = 0;
   }
 
-  /* should the job run in the background? */
-  if ((bg = (*argv[argc-1] == '&')) != 0) {
-    argv[--argc] = NULL;
+  if (nstages > 1) { //a | b | ...: cut argv into one vector per stage
+
+	char** stagev[nstages];
+	int k = 0;
+
+	stagev[k++] = env;
+	for (int i = 0; i < nwords; i++) {
+
+		if (tokop(argv[i]) == OP_PIPE) {
+
+			argv[i] = NULL;
+			stagev[k++] = &argv[i + 1];
+		}
+	}
+	eval_pipeline(stagev, nstages, cmdline, if_bg, timed, limit);
+	return;
   }
-  return bg;
-}
 
-/* 
- * builtin_cmd - If user types a built-in command, execute it immediately.
- *    Returns true if a built-in command was specified or false otherwise.
- */
-int builtin_cmd(char** argv) {
-  char* cmd = argv[0];
-  if (!strcmp(cmd, "quit")) { /* quit command */
-    exit(0);  
+  redir_t redirs;
+  int fds[3];
+
+  if (take_redirs(argv, &redirs) < 0 || open_redirs(&redirs, fds) < 0) {
+
+	return;
   }
-  if (!strcmp(cmd, "jobs")) { /* jobs command */
-    listjobs(jobs);
-    return 1;    
+
+  if (!argv[0]) { //only redirections: their files are created, nothing runs
+
+	close_redirs(fds);
+	return;
   }
-  if (!strcmp(cmd, "bg") || !strcmp(cmd, "fg")) { /* bg and fg commands */
-    do_bgfg(argv);
-    return 1;
+
+  //builtins run in the shell, writing to its stdout; under timeout or &
+  //the command found on the PATH runs instead, as it must be a process
+  //to kill or to leave running, but only a BI_STAGE builtin has one
+  const builtin_t* b = find_builtin(argv[0]);
+
+  if (b && if_bg && (!(b->flags & BI_STAGE) || !lookup_cmd(argv[0]))) {
+
+	printf("%s: builtin cannot run in the background\n", argv[0]);
+	close_redirs(fds);
+	return;
   }
-  if (!strcmp(cmd, "&")) { /* ignore & by itself */
-    return 1;
+
+  if (b && !limit && !if_bg) {
+
+	int saved = redirect_stdout(fds[1]);
+
+	if (timed) { //so time the shell
+
+		time_builtin(argv);
+	}
+
+	else {
+
+		builtin_cmd(argv);
+	}
+	restore_stdout(saved);
+	close_redirs(fds);
   }
-  return 0;     /* otherwise, not a builtin command */
-}
 
-/* 
- * do_bgfg - Execute the builtin bg and fg commands.
- */
-void do_bgfg(char** argv) {
+  else {
 
-  char* cmd = argv[0];
+	int errfd = redirs.errdup ? (fds[1] >= 0 ? fds[1] : STDOUT_FILENO) : fds[2];
+
+	sigset_t mask, prev_mask;
+ 	sigemptyset(&mask);
+ 	sigaddset(&mask, SIGCHLD);
+
+	int pid_result;
 
-  //for fg commands
-  if (!strcmp(cmd,"fg")) {
+	if (sigprocmask(SIG_BLOCK, &mask, &prev_mask) == -1) { // block SIGCHLD
 
-	job_t* job;
+		error("sigprocmask is not blocking the sigchld in eval");
+	}
 
-	int mistake_made = 0;
+	char* name = argv[0];
+	t0 = now_ns();
+	char* path = lookup_cmd(name);
 
-	if (!argv[1]) {
+	stat_record(PH_LOOKUP, t0);
 
-		error("fg command requires PID or %%jobid argument\n");
-  	}
+	if (!path) { //not on the PATH, so no point in starting a child
+
+		printf("%s: Command not found\n", name);
+	}
 
-	if (argv[1][0] == '%') { //jid
+	else if (if_bg && after.n && !after_pending()) { //a job it runs after failed
 
-		//update state
-		int jid = atoi(&argv[1][1]); //atoi takes in a string that begins at this indicated character, referenced by the address, and now inputted as a pointer.
+		close_redirs(fds);
+		if (sigprocmask(SIG_SETMASK, &prev_mask, NULL) == -1) {
 
-		if (jid != 0) { //if atoi does not fail
+			error("sigprocmask is not working in eval");
+		}
+		return;
+	}
 
-			job = getjobjid(jobs, jid); //find the job
-			job->state = FG;
+	else if (if_bg && (after.n || queue_full())) { //over setopt maxjobs, or after jobs: wait
 
-			if (kill(-job->pid, SIGCONT) == 1) {
+		if (!enqueue(path, argv, env, nenv, fds, redirs.errdup, cmdline, timed,
+			     limit)) {
 
-				error("kill not working with fg command using a jid in do_bgfg");
-			}
+			close_redirs(fds);
 		}
 
-		else {
+		if (sigprocmask(SIG_SETMASK, &prev_mask, NULL) == -1) {
 
-			mistake_made++;
+			error("sigprocmask is not working in eval");
 		}
+		return;
 	}
 
-	else { //pid
+	int token = path && if_bg ? js_acquire(&prev_mask) : TOKEN_NONE;
 
-		int pid = atoi(&argv[1][1]);
-		job = getjobpid(jobs, pid);
+	if (token == TOKEN_INTR) { //ctrl-c while waiting for the jobserver
 
-		if (!job && pid == 0) {
+		printf("%s: not started\n", name);
+		path = NULL;
+	}
 
-			mistake_made++;
-		}
+	//the job is taken before its process starts, so no process is left without one
+	job_t* job = NULL;
 
-		else {
+	if (path) {
 
-			job->state = FG;
+		t0 = now_ns();
+		job = takejob(&jobs, QU, cmdline);
+		stat_record(PH_ADDJOB, t0);
 
-			if (kill(-pid, SIGCONT) == -1) {
+		if (!job) { //reported: run nothing rather than a process with no job
 
-				error("kill not working with fg command using a pid in do_bgfg");
-			}
+			path = NULL;
 		}
 	}
 
-	if (mistake_made != 0) {
+	//the child starts in its own process group with the shell's original mask
+	pid_result = path ? launch(path, argv, env, nenv, 0, fds[0], fds[1], errfd)
+			  : 0;
+	close_redirs(fds);
+
+	if (pid_result == 0) {
+
+		js_release(token);
+
+		if (job) {
+
+			removejob(&jobs, job);
+		}
+
+		if (path && path != name) { //the cached file has gone away
+
+			forget_cmd(name);
+		}
 
-		printf("argument must be a PID or %%jobid\n");
+		if (sigprocmask(SIG_SETMASK, &prev_mask, NULL) == -1) {
 
+			error("sigprocmask is not working in eval");
+		}
 		return;
 	}
 
-	else {
+	joinjob(&jobs, job, pid_result, 0, if_bg ? BG : FG);
+	job->timed = timed;
+	watchdog_arm(job, limit);
+
+	if ((!if_bg)) { //foreground
+
+		if (sigprocmask(SIG_SETMASK, &prev_mask, NULL) == -1) { //unblock sigchild
+
+			error("sigprocmask is not working in eval");
+		}
 
-		waitfg(job->pid);
+		waitfg(pid_result);
 	}
-  }
 
-  //for bg commands
-  else {
+	else {
 
-	job_t* job;
+		job->token = token; //returned when the job is removed
 
-	int mistake_made = 0;
+		//print before unblocking, since the job may be reaped right after
+		printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
 
-	if (!argv[1]) {
+		if (sigprocmask(SIG_SETMASK, &prev_mask, NULL) == -1) { //unblock sigchild
+
+			error("sigprocmask is not working in eval");
+		}
+	}
+  }
+  return;
+}
+
+/* stage_capture - Run builtin b as a pipeline's first stage, with its
+ *    output in a memfd, or in outfd if it is not -1. Returns the memfd,
+ *    rewound for the next stage to read as its stdin.
+ */
+static int stage_capture(const builtin_t* b, char** argv, int outfd) {
+  int fd = memfd_create("bsh-stage", MFD_CLOEXEC);
+  FILE* out;
+  if (fd < 0 || !(out = fdopen(fcntl(outfd >= 0 ? outfd : fd,
+                                     F_DUPFD_CLOEXEC, 0), "w"))) {
+    error("memfd error");
+  }
+  b->fn(argv, out);
+  fclose(out);
+  lseek(fd, 0, SEEK_SET);
+  return fd;
+}
+
+/* stage_paths_free - Free the paths eval_pipeline copied out of the
+ *    command cache; a path that is the command's own name is not a copy.
+ */
+static void stage_paths_free(char** paths, char*** stagev, int n) {
+  for (int i = 0; i < n; i++) {
+    if (paths[i] && paths[i] != stagev[i][0]) {
+      free(paths[i]);
+    }
+  }
+}
 
-		error("bg command requires PID or %%jobid argument\n");
-  	}
+/*
+ * eval_pipeline - Run the n stages of a pipeline a | b | ... as one
+ *    job. Its processes share the process group of the first, so
+ *    ctrl-c and ctrl-z reach every stage, and each stage's state is
+ *    kept in the job; the job is done when all of them have been
+ *    reaped, and its status is the last stage's. The shell holds the
+ *    ends of the pipes between stages only while it launches.
+ *
+ *    A builtin marked BI_STAGE may be the first or the last stage. As
+ *    the first, it runs to completion with its output in a memfd that
+ *    the next stage then reads as its stdin, so the shell never copies
+ *    data between stages or blocks on a full pipe. As the last, it
+ *    writes to the shell's stdout and its input pipe is closed unread,
+ *    so the stage before it gets SIGPIPE, as from any command that
+ *    stops reading.
+ *
+ *    Each stage may have its own redirections, which take the place of
+ *    its pipe ends; all of their files are opened before any stage is
+ *    started. Under timeout (limit, in ns), the deadline is the whole
+ *    job's, and its signals go to the process group.
+ */
+void eval_pipeline(char*** stagev, int n, char* cmdline, int bg, int timed,
+                   long long limit) {
+  const builtin_t* bi[n];
+  char** envs[n];
+  int nenvs[n];
+  char* paths[n];
+  int stale[n];
+  pid_t pids[n];
+  redir_t redirs[n];
+  int fds[n][3];
+
+  for (int i = 0; i < n; i++) {
+
+	paths[i] = NULL;
+  }
 
-	if (argv[1][0] == '%') { //jid
+  for (int i = 0; i < n; i++) { //check every stage before starting any
 
-		//update state
-		int jid = atoi(&argv[1][1]);
+	char** argv = stagev[i];
 
-		if (jid != 0) {
+	if (take_redirs(argv, &redirs[i]) < 0) {
 
-			job = getjobjid(jobs, jid);
-			job->state = BG;
+		stage_paths_free(paths, stagev, n);
+		return;
+	}
 
-			if (kill(-job->pid, SIGCONT) == -1) {
+	envs[i] = argv; //its VAR=value words
+	nenvs[i] = env_assigns(argv);
+	argv = stagev[i] += nenvs[i];
 
-				error("kill not working with bg command using a jid in do_bgfg");
-			}
-		}
+	if (!argv[0]) {
 
-		else {
-			mistake_made++;
-		}
+		printf("Syntax error: empty pipeline stage\n");
+		stage_paths_free(paths, stagev, n);
+		return;
 	}
 
-	else {
+	if (i > 0 && !strcmp(argv[0], "after")) { //a prefix of the whole line only
 
-		int pid = atoi(&argv[1][1]);
-		job = getjobpid(jobs, pid);
+		printf("after: must come before the whole pipeline\n");
+		stage_paths_free(paths, stagev, n);
+		return;
+	}
 
-		if (!job && pid == 0) {
+	bi[i] = find_builtin(argv[0]);
 
-			mistake_made++;
-		}
+	if (bi[i] && bg && (bi[i]->flags & BI_STAGE) && lookup_cmd(argv[0])) { //with &, the command on the PATH, so nothing waits
 
-		else {
+		bi[i] = NULL;
+	}
 
-			job->state = BG;
+	if (bi[i]) {
 
-			if (kill(-pid, SIGCONT) == -1) {
+		if (!(bi[i]->flags & BI_STAGE) || (i > 0 && i < n - 1)) {
 
-				error("kill not working with bg command using a pid in do_bgfg");
-			}
+			printf("%s: builtin cannot be used at this stage of a pipeline\n", argv[0]);
+			stage_paths_free(paths, stagev, n);
+			return;
 		}
+		continue;
 	}
 
-	if (mistake_made != 0) {
+	long long t0 = now_ns();
+	paths[i] = lookup_cmd(argv[0]);
+
+	stat_record(PH_LOOKUP, t0);
 
-		printf("argument must be a PID or %%jobid\n");
+	//a later stage's lookup may clear the cache, so keep a copy
+	if (paths[i] && paths[i] != argv[0] && !(paths[i] = strdup(paths[i]))) {
 
+		printf("%s: out of memory\n", argv[0]);
+		stage_paths_free(paths, stagev, n);
 		return;
 	}
 
-	printf("[%d] %d %s\n", job->jid, job->pid, job->cmdline);
+	if (!paths[i]) {
+
+		printf("%s: Command not found\n", argv[0]);
+		stage_paths_free(paths, stagev, n);
+		return;
+	}
   }
 
-  return;
-}
+  for (int i = 0; i < n; i++) {
 
-/* 
- * waitfg - Block until process pid is no longer the foreground process.
- */
-void waitfg(pid_t pid) {
+	if (open_redirs(&redirs[i], fds[i]) < 0) {
 
-  sigset_t mask;
-  sigemptyset(&mask);
+		while (--i >= 0) {
+
+			close_redirs(fds[i]);
+		}
+		stage_paths_free(paths, stagev, n);
+		return;
+	}
+  }
 
-  while (fgpid(jobs) == pid) {
+  //stages [first, last) are processes; a builtin at either end is not
+  int first = bi[0] != NULL;
+  int last = bi[n - 1] ? n - 1 : n;
+  int infd = first ? stage_capture(bi[0], stagev[0], fds[0][1]) : -1;
+  pid_t pgid = 0;
 
-	sigsuspend(&mask);
+  if (first) {
+
+	close_redirs(fds[0]);
   }
 
-  return;
-}
+  sigset_t mask, prev_mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
 
-/*****************
- * Signal handlers
- *****************/
+  if (sigprocmask(SIG_BLOCK, &mask, &prev_mask) == -1) { // block SIGCHLD
 
-//use safe_printf
+	error("sigprocmask is not blocking the sigchld in eval_pipeline");
+  }
 
-/* 
- * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
- *     a child job terminates (becomes a zombie), or stops because it
- *     received a SIGSTOP or SIGTSTP signal. The handler should reap
- *     all available zombie children, but should not wait for any other
- *     currently running children to terminate.  
- */
-void sigchld_handler(int sig) { // cleanup
+  int token = bg && first < last ? js_acquire(&prev_mask) : TOKEN_NONE;
+  int halted = token == TOKEN_INTR; //ctrl-c while waiting for the jobserver
+  job_t* job = NULL;
+  int nstages = n - first;
 
-  int status;
-  pid_t pid;
+  //the job and its stages are taken before any process starts, so none is left without them
+  if (!halted && first < last) {
 
-  while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0) { //check all children and if any child finishes, then clean a proceess and return its pid
-  //WNOHANG ensures that the child is not already terminated/stopped and WUNTRACED also waits for stopped/suspended children
-  //this signal is blocked by a signal mask in eval in advance so it only reaches this stage at the right time
+	long long t0 = now_ns();
 
-	//depending on how child exited... 3 options...
-	if (WIFEXITED(status)) { //child is finished, update
+	job = takejob(&jobs, QU, cmdline);
+	if (job && (!pidindex_reserve(&jobs, last - first)
+		    || !(job->stages = blockalloc(nstages * sizeof(stage_t))))) {
 
-		deletejob(jobs, pid);
+		removejob(&jobs, job);
+		job = NULL;
+		printf("Tried to create too many jobs\n");
 	}
+	stat_record(PH_ADDJOB, t0);
 
-	if (WIFSIGNALED(status)) { //child exited due to unhandled signal. Update and account for message to print out about how it was signaled using printf.
+	if (job) {
 
-		job_t* job = getjobpid(jobs,pid);
-		safe_printf("Job [%d] (%d) terminated by signal %d\n",job->jid,job->pid, WTERMSIG(status));
-		deletejob(getjobpid(jobs,pid), pid);
+		job->nstages = nstages;
 	}
+	halted = !job;
+  }
+
+  if (halted) { //start nothing
 
-	if (WIFSTOPPED(status)) { //if stopped. Update state if necessary. don't delete job for this
+	printf("pipeline not started\n");
+	for (int i = first; i < n; i++) {
 
-		getjobpid(jobs,pid)->state = ST;
-		safe_printf("Job [%d] (%d) stopped by signal %d\n",getjobpid(jobs,pid)->jid,getjobpid(jobs,pid)->pid,WSTOPSIG(status));
+		close_redirs(fds[i]);
 	}
+	first = last = n;
   }
 
-  return;
-}
+  for (int i = first; i < last; i++) {
 
-/* 
- * sigint_handler - The kernel sends a SIGINT to the shell whenever user
- *    types ctrl-c at the keyboard. Forward it to the foreground job.
- */
-void sigint_handler(int sig) {
+	int pfd[2] = { -1, -1 };
 
-  pid_t job_pid = fgpid(jobs);
+	if (i < n - 1 && pipe2(pfd, O_CLOEXEC) < 0) {
 
-  if (job_pid) {
+		error("pipe error");
+	}
 
-	if (kill(-job_pid,SIGINT) == -1) {
+	//a stage's own redirections replace its pipe ends
+	int in = fds[i][0] >= 0 ? fds[i][0] : infd;
+	int out = fds[i][1] >= 0 ? fds[i][1] : pfd[1];
+	int err = !redirs[i].errdup ? fds[i][2] : out >= 0 ? out : STDOUT_FILENO;
 
-		error("kill not working with command using the foreground pid in sigint_handler");
-	}
-  }
+	//the first process started leads the group the rest join
+	pids[i] = launch(paths[i], stagev[i], envs[i], nenvs[i], pgid, in, out,
+			 err);
+	close_redirs(fds[i]);
 
-  return;
-}
+	//the cached file has gone away, but later stages may still use its path
+	stale[i] = pids[i] == 0 && paths[i] != stagev[i][0];
 
-/*
- * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
- *     user types ctrl-z at the keyboard. Forward it to the foreground job.
- */
-void sigtstp_handler(int sig) {
+	if (pgid == 0) {
 
-  pid_t job_pid = fgpid(jobs);
+		pgid = pids[i];
+	}
+
+	if (infd >= 0) {
 
-  if (job_pid) {
+		close(infd);
+	}
 
-	if (kill(-job_pid,SIGTSTP) == -1) {
+	if (pfd[1] >= 0) {
 
-		error("kill not working with command using the foreground pid in sigtstp_handler");
+		close(pfd[1]);
 	}
+	infd = pfd[0];
   }
 
-  return;
-}
+  if (infd >= 0) { //a builtin last stage doesn't read its input
 
-/*
- * sigquit_handler - Terminate the shell on receipt of a SIGQUIT.
- *    Used by the driver program; do not modify.
- */
-void sigquit_handler(int sig) {
-  printf("Terminating after receipt of SIGQUIT signal\n");
-  exit(1);
-}
+	close(infd);
+  }
 
-/***********************************************
- * Helper routines that manipulate the job list
- **********************************************/
+  for (int i = first; i < last; i++) {
 
-/* clearjob - Clear the entries in a job struct. */
-void clearjob(job_t* job) {
-  job->pid = 0;
-  job->jid = 0;
-  job->state = UNDEF;
-  job->cmdline[0] = '\0';
-}
+	if (stale[i]) {
+
+		forget_cmd(stagev[i][0]);
+	}
+  }
+  stage_paths_free(paths, stagev, n);
+
+  //the group leader is the first process that started; any before it are done
+  int lead = first;
+  while (lead < last && pids[lead] == 0) {
+
+	lead++;
+  }
+
+  if (job && pgid == 0) { //none of its processes started
+
+	removejob(&jobs, job);
+	job = NULL;
+  }
+
+  if (!job) {
+
+	js_release(token);
+  }
+
+  if (job) {
+
+	for (int k = 0; k < nstages; k++) {
+
+		int i = first + k;
+		stage_t* stage = &job->stages[k];
+
+		stage->pid = i < last ? pids[i] : 0;
+		stage->state = stage->pid ? SG_RUNNING : SG_DONE;
+		stage->status = stage->pid ? 0 : W_EXITCODE(127, 0);
+	}
+
+	//the leader is attached first; the rest follow it
+	joinjob(&jobs, job, pgid, lead - first, bg ? BG : FG);
+	for (int i = lead + 1; i < last; i++) {
+
+		if (pids[i]) {
+
+			attachpid(&jobs, job, pids[i], i - first);
+		}
+	}
+	job->timed = timed;
+	job->token = token;
+	watchdog_arm(job, limit);
+
+	if (bg) { //print before unblocking, since the job may be reaped right after
+
+		printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
+	}
+  }
+
+  if (last < n && !halted) { //the last stage is a builtin; its status is the job's
+
+	int jid = job ? job->jid : 0;
+	int saved = redirect_stdout(fds[n - 1][1]);
+	int status = W_EXITCODE(bi[n - 1]->fn(stagev[n - 1], stdout) & 0xff, 0);
+
+	restore_stdout(saved);
+	close_redirs(fds[n - 1]);
+
+	job = getjobjid(&jobs, jid);
+	if (job && job->pid == pgid) {
+
+		job->stages[nstages - 1].status = status;
+	}
+  }
+
+  if (sigprocmask(SIG_SETMASK, &prev_mask, NULL) == -1) { //unblock sigchild
+
+	error("sigprocmask is not working in eval_pipeline");
+  }
+
+  if (job && !bg) {
+
+	waitfg(pgid);
+  }
+}
+
+/*
+ * launch - Run the file path with arguments argv as a child in process
+ *    group pgid (0 for a new group led by the child), with the signal
+ *    mask the shell started with and, where infd, outfd or errfd is
+ *    not -1, with that as its standard input, output or error. Returns
+ *    the child's pid, or 0 if no child is left running because the
+ *    command could not be executed (which has then been reported).
+ *    The child gets the shell's environment with the nenv VAR=value
+ *    words env on top.
+ *
+ *    The default path uses posix_spawn, which glibc implements with
+ *    clone(CLONE_VM|CLONE_VFORK), so launch cost does not grow with the
+ *    shell's memory footprint. The -F path is the classic fork and
+ *    execve. With -v, the time from the start of the launch until the
+ *    child has exec'd is reported for either path. Never called from a
+ *    signal handler: launches the reap path makes possible are left to
+ *    the main line (see defer_launch).
+ */
+pid_t launch(char* path, char** argv, char** env, int nenv, pid_t pgid,
+             int infd, int outfd, int errfd) {
+  long long start, t0;
+  const char* how;
+  pid_t pid;
+  char* saved[nenv + 1];
+  char** envp;
+
+  out_flush(); /* our output so far comes before the child's */
+  start = now_ns();
+  if (!(envp = env_overlay(env, nenv, saved))) {
+    printf("%s: out of memory\n", argv[0]);
+    return 0;
+  }
+
+  if (launch_mode == LAUNCH_SPAWN) {
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    short flags = POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK;
+#ifdef POSIX_SPAWN_USEVFORK
+    flags |= POSIX_SPAWN_USEVFORK;
+#endif
+    how = "posix_spawn";
+    if (posix_spawnattr_init(&attr) != 0) {
+      error("posix_spawnattr_init error");
+    }
+    posix_spawnattr_setflags(&attr, flags);
+    posix_spawnattr_setpgroup(&attr, pgid);
+    posix_spawnattr_setsigmask(&attr, &child_sigmask);
+    posix_spawn_file_actions_init(&actions);
+    if (infd >= 0) {
+      posix_spawn_file_actions_adddup2(&actions, infd, STDIN_FILENO);
+    }
+    if (outfd >= 0) {
+      posix_spawn_file_actions_adddup2(&actions, outfd, STDOUT_FILENO);
+    }
+    if (errfd >= 0) {
+      posix_spawn_file_actions_adddup2(&actions, errfd, STDERR_FILENO);
+    }
+    int err = posix_spawn(&pid, path, &actions, &attr, argv, envp);
+    env_restore(env, nenv, saved);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+      printf("%s: Command not found\n", argv[0]);
+      return 0;
+    }
+    stat_record(PH_EXEC, start); /* returns once the child has exec'd */
+  } else {
+    int sync[2]; /* closed by the child's exec, so EOF marks the exec */
+    int timed = verbose;
+    how = "fork";
+    if (timed && pipe2(sync, O_CLOEXEC) < 0) {
+      error("pipe error");
+    }
+    if ((pid = fork()) == 0) {
+      outring.tail = outring.head; /* the shell's output, not ours */
+      outring.busy = 0;
+      evlog.tail = evlog.head;
+      evlog.busy = 0;
+      if (setpgid(0, pgid) == -1) {
+        error("setpgid error");
+      }
+      if (sigprocmask(SIG_SETMASK, &child_sigmask, NULL) == -1) {
+        error("sigprocmask error");
+      }
+      if (infd >= 0) {
+        dup2(infd, STDIN_FILENO);
+      }
+      if (outfd >= 0) {
+        dup2(outfd, STDOUT_FILENO);
+      }
+      if (errfd >= 0) {
+        dup2(errfd, STDERR_FILENO);
+      }
+      execve(path, argv, envp);
+      printf("%s: Command not found\n", argv[0]);
+      exit(0);
+    }
+    env_restore(env, nenv, saved);
+    if (pid < 0) {
+      error("fork error");
+    }
+    stat_record(PH_FORK, start);
+    t0 = now_ns();
+    setpgid(pid, pgid ? pgid : pid); /* in case we signal it before exec */
+    stat_record(PH_SETPGID, t0);
+    if (timed) {
+      char c;
+      close(sync[1]);
+      while (read(sync[0], &c, 1) < 0 && errno == EINTR) {
+        ;
+      }
+      close(sync[0]);
+      stat_record(PH_EXEC, start);
+    }
+  }
+
+  if (verbose) {
+    long usecs = (now_ns() - start) / 1000;
+    printf("Launched (%d) via %s: fork-to-exec %ld us\n", pid, how, usecs);
+  }
+  return pid;
+}
+
+/* Character classes for tokenize: a word runs until a blank, an
+ * operator or NUL, and quotes and backslashes take it out of its fast
+ * path */
+#define TK_PLAIN 0
+#define TK_BLANK 1
+#define TK_QUOTE 2
+#define TK_END   3
+#define TK_OPER  4
+static const unsigned char tokclass[256] = {
+  ['\0'] = TK_END, [' '] = TK_BLANK, ['\t'] = TK_BLANK, ['\n'] = TK_BLANK,
+  ['\''] = TK_QUOTE, ['"'] = TK_QUOTE, ['\\'] = TK_QUOTE, ['|'] = TK_OPER
+};
+
+/* tokscan - The operator that starts at p, storing its length in *len.
+ *    p is at a '|', or at a word-initial '<', '>' or "2>".
+ */
+static int tokscan(const char* p, int* len) {
+  *len = 1;
+  switch (*p) {
+    case '|':
+      return OP_PIPE;
+    case '<':
+      if (p[1] == '<') {
+        *len = p[2] == '<' ? 3 : 2;
+        return *len == 3 ? OP_HERESTR : OP_HEREDOC;
+      }
+      return OP_IN;
+    case '2':
+      if (!strncmp(p, "2>&1", 4)) {
+        *len = 4;
+        return OP_ERRDUP;
+      }
+      *len = 2;
+      return OP_ERR;
+    default:
+      if (p[1] == '>') {
+        *len = 2;
+        return OP_APPEND;
+      }
+      return OP_OUT;
+  }
+}
+
+#define TK_PAD 16 /* zeroed bytes after a line's NUL, for 16-byte loads */
+
+#ifdef __SSE2__
+/*
+ * tokenize_plain - tokenize's fast path, for a line of words that are
+ *    nothing but plain characters, sixteen bytes at a time: blanks
+ *    become NULs in place and the word starts come from a bit mask.
+ *    buf holds the line, of length len, and TK_PAD zeroed bytes after
+ *    it. Returns the number of words, or -1 if the line has a quote,
+ *    backslash or operator character; buf may then be part cut.
+ */
+static int tokenize_plain(char* buf, size_t len, char** argv) {
+  const __m128i space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'),
+      nl = _mm_set1_epi8('\n'), squote = _mm_set1_epi8('\''),
+      dquote = _mm_set1_epi8('"'), bslash = _mm_set1_epi8('\\'),
+      bar = _mm_set1_epi8('|'), lt = _mm_set1_epi8('<'),
+      gt = _mm_set1_epi8('>');
+  unsigned inword = 0; /* did the last block end inside a word? */
+  int argc = 0;
+
+  for (size_t i = 0; i < len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(buf + i));
+    __m128i other = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, squote), _mm_cmpeq_epi8(v, dquote)),
+        _mm_or_si128(_mm_cmpeq_epi8(v, bslash), _mm_cmpeq_epi8(v, bar)));
+    other = _mm_or_si128(other,
+        _mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)));
+    if (_mm_movemask_epi8(other)) {
+      return -1;
+    }
+    __m128i blank = _mm_or_si128(_mm_cmpeq_epi8(v, space),
+        _mm_or_si128(_mm_cmpeq_epi8(v, tab), _mm_cmpeq_epi8(v, nl)));
+    _mm_storeu_si128((__m128i*)(buf + i), _mm_andnot_si128(blank, v));
+
+    unsigned words = ~_mm_movemask_epi8(blank) & 0xffff;
+    if (len - i < 16) { /* past the NUL is not a word */
+      words &= (1u << (len - i)) - 1;
+    }
+    unsigned starts = words & ~(words << 1 | inword);
+    inword = words >> 15;
+    while (starts) {
+      argv[argc++] = buf + i + __builtin_ctz(starts);
+      starts &= starts - 1;
+    }
+  }
+  return argc;
+}
+#endif
+
+/* tokop - The operator a word from tokenize stands for, or -1 if it
+ *    is an ordinary word.
+ */
+int tokop(const char* word) {
+  uintptr_t w = (uintptr_t)word, base = (uintptr_t)tok_ops;
+  if (w >= base && w < base + sizeof(tok_ops)) {
+    return (w - base) / sizeof(tok_ops[0]);
+  }
+  return -1;
+}
+
+/*
+ * tokenize - Split a command line into words, in one pass, into an
+ *    arena the caller owns and reuses: arena->argv gets the words and a
+ *    terminating NULL. Returns the number of words, or -1 if a quote
+ *    is left open. *bg is set if the last word is an unquoted '&'
+ *    (which is then dropped), as a request to run the job in the
+ *    background.
+ *
+ *    Words are separated by blanks. '...' is taken literally, and
+ *    "..." also keeps blanks and single quotes, with \" and \\ for a
+ *    quote or backslash; quoted and unquoted parts of a word join up.
+ *    Outside quotes a backslash escapes a blank, quote, backslash, '&'
+ *    or operator character; before any other character it is kept, so
+ *    that echo -e still sees its \NNN escapes. An unquoted operator is
+ *    a word by itself, returned as its entry in tok_ops (tokop tells
+ *    which): '|' anywhere, and < << <<< > >> 2> 2>&1 at the start of a
+ *    word, with or without a blank after. A '>' inside a word, as in
+ *    the traces' "echo -e bsh> jobs", is an ordinary character.
+ *
+ *    No word is longer than the line, and there are no more words than
+ *    characters, so the arena is sized once per line from the line's
+ *    length and never grows mid-line: lines and argument lists have no
+ *    fixed limit, and there is no allocation per word.
+ *
+ *    Where SSE2 is available, a line of only plain words and blanks,
+ *    the usual kind, is cut by tokenize_plain instead.
+ */
+int tokenize(const char* cmdline, arena_t* arena, int* bg) {
+  size_t len = strlen(cmdline);
+  if (arena->cap < len + 1 + TK_PAD) {
+    free(arena->buf);
+    arena->cap = len + 1 + TK_PAD > MAXLINE ? len + 1 + TK_PAD : MAXLINE;
+    if (!(arena->buf = malloc(arena->cap))) {
+      error("tokenize: out of memory");
+    }
+  }
+  if (arena->argcap < len + 1) {
+    free(arena->argv);
+    arena->argcap = len + 1;
+    if (!(arena->argv = malloc(arena->argcap * sizeof(char*)))) {
+      error("tokenize: out of memory");
+    }
+  }
+
+  /* words are cut in place in a copy of the line; quotes and escapes
+   * make them shorter, so the write position never passes the read */
+  memcpy(arena->buf, cmdline, len + 1);
+  memset(arena->buf + len + 1, 0, TK_PAD);
+  char* p = arena->buf;
+  char* out = p;
+  char** argv = arena->argv;
+  int argc = 0;
+  int amp = 0; /* does the current word start with an unquoted '&'? */
+
+#ifdef __SSE2__
+  if ((argc = tokenize_plain(p, len, argv)) >= 0) {
+    amp = argc > 0 && argv[argc - 1][0] == '&';
+    p += len; /* at the NUL: the loop below finds nothing more */
+  } else {
+    argc = 0;
+    memcpy(p, cmdline, len + 1); /* undo what it cut */
+  }
+#endif
+
+  while (1) {
+    while (tokclass[(unsigned char)*p] == TK_BLANK) {
+      p++;
+    }
+    if (!*p) {
+      break;
+    }
+    if (tokclass[(unsigned char)*p] == TK_OPER || *p == '<' || *p == '>'
+        || (*p == '2' && p[1] == '>')) {
+      int len;
+      argv[argc++] = tok_ops[tokscan(p, &len)];
+      amp = 0;
+      p += len;
+      continue;
+    }
+    argv[argc++] = out;
+    amp = (*p == '&');
+    while (1) {
+      char* run = p;
+      while (tokclass[(unsigned char)*p] == TK_PLAIN) {
+        p++;
+      }
+      if (out != run) { /* shifted down by an earlier quote or escape */
+        memmove(out, run, p - run);
+      }
+      out += p - run;
+      if (tokclass[(unsigned char)*p] != TK_QUOTE) { /* blank, operator, end */
+        break;
+      }
+      if (*p == '\'') { /* everything up to the closing quote */
+        for (p++; *p != '\''; ) {
+          if (!*p) {
+            return -1;
+          }
+          *out++ = *p++;
+        }
+        p++;
+      } else if (*p == '"') {
+        for (p++; *p != '"'; ) {
+          if (!*p) {
+            return -1;
+          }
+          if (*p == '\\' && (p[1] == '"' || p[1] == '\\')) {
+            p++;
+          }
+          *out++ = *p++;
+        }
+        p++;
+      } else if (*p == '\\' && p[1] && strchr(" \t'\"\\&|<>", p[1])) {
+        *out++ = p[1];
+        p += 2;
+      } else { /* a backslash that escapes nothing is kept */
+        *out++ = *p++;
+      }
+    }
+    char c = *p;
+    int op = -1, len = 1;
+    if (tokclass[(unsigned char)c] == TK_OPER) { /* ended by an operator */
+      op = tokscan(p, &len);
+    }
+    *out++ = '\0'; /* may overwrite the blank at p, which is done with */
+    if (!c) {
+      break;
+    }
+    p += len;
+    if (op >= 0) {
+      argv[argc++] = tok_ops[op];
+      amp = 0;
+    }
+  }
+  argv[argc] = NULL;
+
+  *bg = argc > 0 && amp;
+  if (*bg) {
+    argv[--argc] = NULL;
+  }
+  return argc;
+}
+
+/*
+ * take_redirs - Remove the redirections from a command's words,
+ *    recording them in r. A later redirection of the same fd replaces
+ *    an earlier one, and 2>&1 sends stderr wherever stdout ends up,
+ *    wherever it appears. A here-document claims the next memfd that
+ *    read_heredocs made. Returns -1, having reported it, if an
+ *    operator has no file name after it.
+ */
+int take_redirs(char** argv, redir_t* r) {
+  static const int flags[] = {
+    [OP_IN] = O_RDONLY,
+    [OP_OUT] = O_WRONLY | O_CREAT | O_TRUNC,
+    [OP_APPEND] = O_WRONLY | O_CREAT | O_APPEND,
+    [OP_ERR] = O_WRONLY | O_CREAT | O_TRUNC
+  };
+  char** out = argv;
+
+  memset(r, 0, sizeof(*r));
+  r->herefd = -1;
+  for (; *argv; argv++) {
+    int op = tokop(*argv);
+    if (op < 0 || op == OP_PIPE) {
+      *out++ = *argv;
+      continue;
+    }
+    if (op == OP_ERRDUP) {
+      r->errdup = 1;
+      continue;
+    }
+    if (!argv[1] || tokop(argv[1]) >= 0) {
+      printf("Syntax error: no file name after %s\n", *argv);
+      return -1;
+    }
+    if (op == OP_HERESTR || op == OP_HEREDOC) { /* in place of any < file */
+      r->path[STDIN_FILENO] = NULL;
+      r->here = op == OP_HERESTR ? *++argv : NULL;
+      r->herefd = op == OP_HEREDOC ? heredocs.fds[heredocs.next++] : -1;
+      argv += op == OP_HEREDOC;
+      continue;
+    }
+    int fd = op == OP_IN ? STDIN_FILENO
+           : op == OP_ERR ? STDERR_FILENO : STDOUT_FILENO;
+    r->path[fd] = *++argv;
+    r->flags[fd] = flags[op] | O_CLOEXEC;
+    if (fd == STDIN_FILENO) {
+      r->here = NULL;
+      r->herefd = -1;
+    }
+  }
+  *out = NULL;
+  return 0;
+}
+
+/*
+ * open_redirs - Open the files of a command's redirections, in the
+ *    shell and close-on-exec, so that a bad file is reported before
+ *    anything starts and no descriptor leaks into other children. A
+ *    here-string or here-document is a memfd instead.
+ *    fds[fd] gets the descriptor for fd, or -1. Returns -1 if a file
+ *    could not be opened, which has been reported.
+ */
+int open_redirs(redir_t* r, int fds[3]) {
+  for (int fd = 0; fd < 3; fd++) {
+    fds[fd] = -1;
+  }
+  if (r->here) {
+    fds[STDIN_FILENO] = here_string(r->here);
+  } else if (r->herefd >= 0) { /* its offset is shared, but only one reads */
+    fds[STDIN_FILENO] = fcntl(r->herefd, F_DUPFD_CLOEXEC, 0);
+  }
+  for (int fd = 0; fd < 3; fd++) {
+    if (r->path[fd] && (fds[fd] = open(r->path[fd], r->flags[fd], 0666)) < 0) {
+      printf("%s: %s\n", r->path[fd], strerror(errno));
+      close_redirs(fds);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* close_redirs - Close the descriptors open_redirs opened. */
+void close_redirs(int fds[3]) {
+  for (int fd = 0; fd < 3; fd++) {
+    if (fds[fd] >= 0) {
+      close(fds[fd]);
+      fds[fd] = -1;
+    }
+  }
+}
+
+/*
+ * The text of a here-string (<<< word) or here-document (<<WORD and the
+ * lines up to WORD) is written once into a memfd, which is sealed
+ * against any change and rewound, and the command gets it as stdin:
+ * no temporary file, no disk I/O, no process feeding a pipe, and the
+ * command can mmap its input like any file. A line's here-documents
+ * are read from the shell's input before anything on the line runs,
+ * so their lines are consumed even if the command fails to start.
+ */
+
+/* here_seal - Seal a here memfd against change and rewind it. */
+static int here_seal(int fd) {
+  fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE
+        | F_SEAL_SEAL);
+  lseek(fd, 0, SEEK_SET);
+  return fd;
+}
+
+/* here_string - A sealed memfd holding word and a newline. */
+int here_string(const char* word) {
+  int fd = memfd_create("bsh-here", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  struct iovec iov[2] = {
+    { (void*) word, strlen(word) },
+    { "\n", 1 }
+  };
+  if (fd < 0 || writev(fd, iov, 2) < 0) {
+    error("here-string error");
+  }
+  return here_seal(fd);
+}
+
+/* here_doc - A sealed memfd holding the input lines up to delim. */
+static int here_doc(const char* delim) {
+  int fd = memfd_create("bsh-here", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  FILE* body;
+  if (fd < 0 || !(body = fdopen(fcntl(fd, F_DUPFD_CLOEXEC, 0), "w"))) {
+    error("here-document error");
+  }
+  size_t dlen = strlen(delim);
+  char* line;
+  while (1) {
+    if (!(line = input_readline(&input))) {
+      printf("warning: here-document ended by end of input (wanted %s)\n",
+             delim);
+      break;
+    }
+    if (!strncmp(line, delim, dlen) && line[dlen] == '\n') {
+      break;
+    }
+    fputs(line, body);
+  }
+  fclose(body);
+  return here_seal(fd);
+}
+
+/*
+ * read_heredocs - Read the bodies of the here-documents in a line's
+ *    words, in order, for take_redirs to claim. Returns how many.
+ */
+int read_heredocs(char** argv) {
+  for (; *argv; argv++) {
+    if (tokop(*argv) != OP_HEREDOC || !argv[1] || tokop(argv[1]) >= 0) {
+      continue;
+    }
+    if (heredocs.n == heredocs.cap) {
+      heredocs.cap = heredocs.cap ? 2 * heredocs.cap : 4;
+      heredocs.fds = realloc(heredocs.fds, heredocs.cap * sizeof(int));
+      if (!heredocs.fds) {
+        error("read_heredocs: out of memory");
+      }
+    }
+    heredocs.fds[heredocs.n++] = here_doc(*++argv);
+  }
+  return heredocs.n;
+}
+
+/* close_heredocs - Drop the last line's here-documents; children
+ *    that read them have their own descriptors.
+ */
+void close_heredocs(void) {
+  for (int i = 0; i < heredocs.n; i++) {
+    close(heredocs.fds[i]);
+  }
+  heredocs.n = heredocs.next = 0;
+}
+
+/* redirect_stdout - Point the shell's stdout at fd while a builtin
+ *    runs, if fd is not -1. Returns what restore_stdout needs.
+ */
+int redirect_stdout(int fd) {
+  if (fd < 0) {
+    return -1;
+  }
+  out_flush();
+  int saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+  dup2(fd, STDOUT_FILENO);
+  return saved;
+}
+
+/* restore_stdout - Undo redirect_stdout. */
+void restore_stdout(int saved) {
+  if (saved >= 0) {
+    out_flush();
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+  }
+}
+
+/* 
+ * builtin_cmd - If user types a built-in command, execute it immediately.
+ *    Returns true if a built-in command was specified or false otherwise.
+ */
+int builtin_cmd(char** argv) {
+  const builtin_t* b = find_builtin(argv[0]);
+  if (!b) {
+    return 0;     /* not a builtin command */
+  }
+  b->fn(argv, stdout);
+  return 1;
+}
+
+/* 
+ * do_bgfg - Execute the builtin bg and fg commands.
+ */
+void do_bgfg(char** argv) {
+
+  char* cmd = argv[0];
+  int state = !strcmp(cmd, "fg") ? FG : BG;
+  job_t* job;
+
+  if (!argv[1]) {
+
+	printf("%s command requires PID or %%jobid argument\n", cmd);
+	return;
+  }
+
+  if (argv[1][0] == '%') { //jid
+
+	if (!(job = getjobjid(&jobs, atoi(&argv[1][1])))) {
+
+		printf("%s: No such job\n", argv[1]);
+		return;
+	}
+  }
+
+  else if (isdigit((unsigned char)argv[1][0])) { //pid
+
+	pid_t pid = atoi(argv[1]);
+
+	if (!(job = getjobpid(&jobs, pid))) {
+
+		printf("(%d): No such process\n", pid);
+		return;
+	}
+  }
+
+  else {
+
+	printf("%s: argument must be a PID or %%jobid\n", cmd);
+	return;
+  }
+
+  if (job->state == WA) { //can't start before its jobs
+
+	printf("[%d] is waiting for the jobs it runs after\n", job->jid);
+	return;
+  }
+
+  if (job->state == QU) { //never started: start it now, over the limit
+
+	if (!run_queued(job, state)) {
+
+		return;
+	}
+  }
+
+  else {
+
+	setjobstate(&jobs, job, state);
+
+	if (kill(-job->pgid, SIGCONT) == -1) {
+
+		error("kill not working with the bg or fg command in do_bgfg");
+	}
+  }
+
+  if (job->batch) { //fill the slots that stayed empty while stopped
+
+	resume_batch(job);
+  }
+
+  if (state == FG) {
+
+	waitfg(job->pid);
+  }
+
+  else {
+
+	printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
+  }
+}
+
+/* 
+ * waitfg - Block until process pid is no longer the foreground process.
+ */
+void waitfg(pid_t pid) {
+
+  long long t0 = now_ns();
+
+  if (event_mode) { //events are dispatched from here, no signals
+
+	while (fgpid(&jobs) == pid) {
+
+		event_wait(0, -1);
+	}
+	stat_record(PH_WAITFG, t0);
+	return;
+  }
+
+  sigset_t mask;
+  sigemptyset(&mask);
+
+  while (fgpid(&jobs) == pid) {
+
+	sigsuspend(&mask);
+	run_deferred();
+  }
+
+  stat_record(PH_WAITFG, t0);
+  return;
+}
+
+/******************
+ * Builtin commands
+ ******************/
+
+/*
+ * Builtins run inside the shell, without creating a process. They are
+ * found through a perfect hash: bhash gives every builtin name its own
+ * slot in a fixed table, so a lookup is one hash and one strcmp. The
+ * slots below were computed from bhash; initbuiltins checks them, so
+ * a builtin added in the wrong slot is caught at startup.
+ *
+ * A builtin gets its arguments and the stream for its output, and
+ * returns an exit status. Those marked BI_STAGE don't touch the job
+ * list or the shell's state, so they can also run as the first or last
+ * stage of a pipeline. With &, one of those gives way to the command of
+ * the same name on the PATH, which runs as a background job; the other
+ * builtins refuse &.
+ */
+
+/* bhash - Slot of a builtin name of length len in the builtin table. */
+static unsigned int bhash(const char* name, size_t len) {
+  return ((unsigned char)name[0] + (unsigned char)name[len - 1] + 7 * len)
+      & (BUILTIN_SLOTS - 1);
+}
+
+/* bi_quit - quit: leave the shell. */
+static int bi_quit(char** argv, FILE* out) {
+  exit(0);
+}
+
+/* bi_jobs - jobs [-l]: list the jobs, with -l their resource usage. */
+static int bi_jobs(char** argv, FILE* out) {
+  if (argv[1] && !strcmp(argv[1], "-l")) {
+    listjobs_long(&jobs);
+  } else {
+    listjobs(&jobs);
+  }
+  return 0;
+}
+
+/* bi_bgfg - bg and fg. */
+static int bi_bgfg(char** argv, FILE* out) {
+  do_bgfg(argv);
+  return 0;
+}
+
+/* bi_parallel - parallel: run a work queue as one job. */
+static int bi_parallel(char** argv, FILE* out) {
+  do_parallel(argv);
+  return 0;
+}
+
+/* bi_setopt - setopt: show or set the shell's options. */
+static int bi_setopt(char** argv, FILE* out) {
+  do_setopt(argv);
+  return 0;
+}
+
+/* bi_wait - wait: wait for background jobs to finish. */
+static int bi_wait(char** argv, FILE* out) {
+  return do_wait(argv);
+}
+
+/* bi_history - history: list or search the command history. */
+static int bi_history(char** argv, FILE* out) {
+  return do_history(argv, out);
+}
+
+/* bi_compgen - compgen: list the completions of a word. */
+static int bi_compgen(char** argv, FILE* out) {
+  return do_compgen(argv, out);
+}
+
+/* bi_hash - hash: show or change the command lookup cache. */
+static int bi_hash(char** argv, FILE* out) {
+  do_hash(argv);
+  return 0;
+}
+
+/* bi_export - export [VAR[=value]...]: set and list variables. */
+static int bi_export(char** argv, FILE* out) {
+  return do_export(argv);
+}
+
+/* bi_unset - unset VAR...: remove variables from the environment. */
+static int bi_unset(char** argv, FILE* out) {
+  return do_unset(argv);
+}
+
+/* bi_stats - stats: print and reset the latency histograms. */
+static int bi_stats(char** argv, FILE* out) {
+  do_stats();
+  return 0;
+}
+
+/* bi_amp - & by itself does nothing. */
+static int bi_amp(char** argv, FILE* out) {
+  return 0;
+}
+
+/* bi_true, bi_false - Succeed, or fail, doing nothing else. */
+static int bi_true(char** argv, FILE* out) {
+  return 0;
+}
+
+static int bi_false(char** argv, FILE* out) {
+  return 1;
+}
+
+/*
+ * put_escape - Write the character for the backslash escape at s (just
+ *    past the backslash), as echo -e and printf understand it. Returns
+ *    the number of characters of s used, or -1 for \c, which ends the
+ *    output. \NNN and \0NNN are octal, as in coreutils echo.
+ */
+static int put_escape(const char* s, FILE* out) {
+  const char* p = s;
+  int c = *p++;
+  switch (c) {
+    case 'a': c = '\a'; break;
+    case 'b': c = '\b'; break;
+    case 'c': return -1;
+    case 'e': c = 033; break;
+    case 'f': c = '\f'; break;
+    case 'n': c = '\n'; break;
+    case 'r': c = '\r'; break;
+    case 't': c = '\t'; break;
+    case 'v': c = '\v'; break;
+    case '\\': break;
+    case '0': case '1': case '2': case '3':
+    case '4': case '5': case '6': case '7': {
+      int digits = (c == '0') ? 3 : 2; /* \0 takes up to three more */
+      c -= '0';
+      while (digits-- > 0 && *p >= '0' && *p <= '7') {
+        c = c * 8 + (*p++ - '0');
+      }
+      break;
+    }
+    default: /* not an escape: the backslash stands for itself */
+      putc('\\', out);
+      if (!c) {
+        return 0;
+      }
+      break;
+  }
+  putc(c, out);
+  return p - s;
+}
+
+/* bi_echo - echo [-neE] [arg ...]: write the arguments. */
+static int bi_echo(char** argv, FILE* out) {
+  int newline = 1, escapes = 0;
+  int i = 1;
+  for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
+    const char* f = argv[i] + 1;
+    if (strspn(f, "neE") != strlen(f)) { /* not an option: an argument */
+      break;
+    }
+    for (; *f; f++) {
+      if (*f == 'n') {
+        newline = 0;
+      } else {
+        escapes = (*f == 'e');
+      }
+    }
+  }
+  for (int first = i; argv[i]; i++) {
+    if (i > first) {
+      putc(' ', out);
+    }
+    if (!escapes) {
+      fputs(argv[i], out);
+      continue;
+    }
+    for (const char* p = argv[i]; *p; p++) {
+      if (*p != '\\') {
+        putc(*p, out);
+        continue;
+      }
+      int used = put_escape(p + 1, out);
+      if (used < 0) { /* \c: no more output at all */
+        return 0;
+      }
+      p += used;
+    }
+  }
+  if (newline) {
+    putc('\n', out);
+  }
+  return 0;
+}
+
+/* printf_arg - Write one argument for a printf conversion. spec is the
+ *    conversion as written, flags, width and precision included.
+ */
+static int printf_arg(const char* spec, size_t speclen, char conv,
+                      const char* arg, FILE* out) {
+  char fmt[64];
+  char* end = NULL;
+  if (speclen > sizeof(fmt) - 4) {
+    printf("printf: %.*s: invalid conversion\n", (int)speclen, spec);
+    return 1;
+  }
+  memcpy(fmt, spec, speclen - 1); /* all but the conversion character */
+  fmt[speclen - 1] = '\0';
+  errno = 0;
+  switch (conv) {
+    case 's':
+      strcat(fmt, "s");
+      fprintf(out, fmt, arg ? arg : "");
+      return 0;
+    case 'c':
+      strcat(fmt, "c");
+      fprintf(out, fmt, arg ? arg[0] : '\0');
+      return 0;
+    case 'd': case 'i': {
+      long long v = arg ? strtoll(arg, &end, 0) : 0;
+      strcat(fmt, "lld");
+      fprintf(out, fmt, v);
+      break;
+    }
+    case 'o': case 'u': case 'x': case 'X': {
+      unsigned long long v = arg ? strtoull(arg, &end, 0) : 0;
+      size_t n = strlen(fmt);
+      fmt[n] = 'l';
+      fmt[n + 1] = 'l';
+      fmt[n + 2] = conv;
+      fmt[n + 3] = '\0';
+      fprintf(out, fmt, v);
+      break;
+    }
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': {
+      double v = arg ? strtod(arg, &end) : 0;
+      size_t n = strlen(fmt);
+      fmt[n] = conv;
+      fmt[n + 1] = '\0';
+      fprintf(out, fmt, v);
+      break;
+    }
+    default:
+      printf("printf: %%%c: invalid conversion\n", conv);
+      return 1;
+  }
+  if (arg && (end == arg || *end || errno)) {
+    printf("printf: %s: invalid number\n", arg);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * bi_printf - printf format [arg ...]: write the arguments as format
+ *    directs. The format is reused while arguments remain, and missing
+ *    arguments count as empty or zero, as in coreutils printf.
+ */
+static int bi_printf(char** argv, FILE* out) {
+  if (!argv[1]) {
+    printf("printf: usage: printf format [arguments]\n");
+    return 2;
+  }
+  const char* format = argv[1];
+  char** args = argv + 2;
+  int status = 0;
+  int used;
+  do {
+    used = 0;
+    for (const char* f = format; *f; f++) {
+      if (*f == '\\') {
+        int n = put_escape(f + 1, out);
+        if (n < 0) {
+          return status;
+        }
+        f += n;
+      } else if (*f != '%') {
+        putc(*f, out);
+      } else if (f[1] == '%') {
+        putc('%', out);
+        f++;
+      } else {
+        const char* spec = f++;
+        f += strspn(f, "-+ #0");
+        f += strspn(f, "0123456789");
+        if (*f == '.') {
+          f++;
+          f += strspn(f, "0123456789");
+        }
+        if (!*f) {
+          printf("printf: %s: missing conversion\n", spec);
+          return 1;
+        }
+        const char* arg = *args;
+        if (arg) {
+          args++;
+          used = 1;
+        }
+        status |= printf_arg(spec, f + 1 - spec, *f, arg, out);
+      }
+    }
+  } while (used && *args);
+  return status;
+}
+
+/* bi_cd - cd [dir | -]: change the working directory, by default to
+ *    $HOME; - goes back to $OLDPWD.
+ */
+static int bi_cd(char** argv, FILE* out) {
+  const char* dir = argv[1];
+  if (!dir) {
+    dir = env_get("HOME");
+  } else if (!strcmp(dir, "-")) {
+    dir = env_get("OLDPWD");
+  }
+  if (!dir) {
+    printf("cd: %s not set\n", argv[1] ? "OLDPWD" : "HOME");
+    return 1;
+  }
+  char* old = getcwd(NULL, 0);
+  char* target = strdup(dir); /* dir may be $OLDPWD, about to change */
+  if (!target || chdir(target) < 0) {
+    printf("cd: %s: %s\n", dir, strerror(errno));
+    free(target);
+    free(old);
+    return 1;
+  }
+  free(target);
+  if (old) {
+    env_set("OLDPWD", old);
+    free(old);
+  }
+  char* cwd = getcwd(NULL, 0);
+  if (cwd) {
+    env_set("PWD", cwd);
+    if (argv[1] && !strcmp(argv[1], "-")) {
+      fprintf(out, "%s\n", cwd);
+    }
+    free(cwd);
+  }
+  cmdtab_chdir();
+  return 0;
+}
+
+/* bi_pwd - pwd: write the working directory. */
+static int bi_pwd(char** argv, FILE* out) {
+  char* cwd = getcwd(NULL, 0);
+  if (!cwd) {
+    printf("pwd: %s\n", strerror(errno));
+    return 1;
+  }
+  fprintf(out, "%s\n", cwd);
+  free(cwd);
+  return 0;
+}
+
+/* test_int - Parse an integer operand of test, or set *bad. */
+static long long test_int(const char* s, int* bad) {
+  char* end;
+  errno = 0;
+  long long v = strtoll(s, &end, 10);
+  if (end == s || *end || errno) {
+    printf("test: %s: integer expression expected\n", s);
+    *bad = 1;
+  }
+  return v;
+}
+
+/* test_eval - Evaluate test's expression of n words: 0 for true, 1 for
+ *    false, 2 for an error.
+ */
+static int test_eval(int n, char** a) {
+  if (n == 0) {
+    return 1;
+  }
+  if (!strcmp(a[0], "!") && n > 1) {
+    int r = test_eval(n - 1, a + 1);
+    return r == 2 ? 2 : !r;
+  }
+  if (n == 1) {
+    return a[0][0] == '\0';
+  }
+  if (n == 2) {
+    const char* op = a[0];
+    const char* s = a[1];
+    struct stat sb;
+    if (op[0] != '-' || !op[1] || op[2]) {
+      printf("test: %s: unary operator expected\n", op);
+      return 2;
+    }
+    switch (op[1]) {
+      case 'z': return s[0] != '\0';
+      case 'n': return s[0] == '\0';
+      case 'e': return stat(s, &sb) != 0;
+      case 'f': return stat(s, &sb) != 0 || !S_ISREG(sb.st_mode);
+      case 'd': return stat(s, &sb) != 0 || !S_ISDIR(sb.st_mode);
+      case 'p': return stat(s, &sb) != 0 || !S_ISFIFO(sb.st_mode);
+      case 's': return stat(s, &sb) != 0 || sb.st_size == 0;
+      case 'h':
+      case 'L': return lstat(s, &sb) != 0 || !S_ISLNK(sb.st_mode);
+      case 'r': return access(s, R_OK) != 0;
+      case 'w': return access(s, W_OK) != 0;
+      case 'x': return access(s, X_OK) != 0;
+      case 't': return !isatty(atoi(s));
+    }
+    printf("test: %s: unary operator expected\n", op);
+    return 2;
+  }
+  if (n == 3) {
+    const char* l = a[0];
+    const char* op = a[1];
+    const char* r = a[2];
+    if (!strcmp(op, "=") || !strcmp(op, "==")) {
+      return strcmp(l, r) != 0;
+    }
+    if (!strcmp(op, "!=")) {
+      return strcmp(l, r) == 0;
+    }
+    static const char* intops[] = { "-eq", "-ne", "-lt", "-le", "-gt", "-ge" };
+    for (int i = 0; i < 6; i++) {
+      if (!strcmp(op, intops[i])) {
+        int bad = 0;
+        long long x = test_int(l, &bad), y = test_int(r, &bad);
+        if (bad) {
+          return 2;
+        }
+        int truth[] = { x == y, x != y, x < y, x <= y, x > y, x >= y };
+        return !truth[i];
+      }
+    }
+    printf("test: %s: binary operator expected\n", op);
+    return 2;
+  }
+  printf("test: too many arguments\n");
+  return 2;
+}
+
+/* bi_test - test expr, or [ expr ]: check files, strings and numbers. */
+static int bi_test(char** argv, FILE* out) {
+  int n = 0;
+  while (argv[n + 1]) {
+    n++;
+  }
+  if (!strcmp(argv[0], "[")) {
+    if (n == 0 || strcmp(argv[n], "]")) {
+      printf("[: missing ]\n");
+      return 2;
+    }
+    n--;
+  }
+  return test_eval(n, argv + 1);
+}
+
+/*
+ * parse_interval - A time interval in seconds, by default or with an
+ *    s, m, h or d suffix, as sleep and timeout take it; -1 if invalid.
+ */
+double parse_interval(const char* s) {
+  char* end;
+  double v = strtod(s, &end);
+  double unit = !strcmp(end, "m") ? 60 : !strcmp(end, "h") ? 3600
+      : !strcmp(end, "d") ? 86400 : 1;
+  if (end == s || !(v >= 0) || (*end && strcmp(end, "s") && unit == 1)) {
+    return -1;
+  }
+  return v * unit;
+}
+
+/*
+ * bi_sleep - sleep secs ...: wait for the total time given, in seconds
+ *    by default or with an s, m, h or d suffix. ctrl-c ends the wait.
+ */
+static int bi_sleep(char** argv, FILE* out) {
+  double secs = 0;
+  if (!argv[1]) {
+    printf("sleep: missing operand\n");
+    return 1;
+  }
+  for (int i = 1; argv[i]; i++) {
+    double v = parse_interval(argv[i]);
+    if (v < 0) {
+      printf("sleep: invalid time interval '%s'\n", argv[i]);
+      return 1;
+    }
+    secs += v;
+  }
+
+  long long deadline = now_ns() + (long long)(secs * 1e9);
+  long long left;
+  shell_interrupted = 0;
+  while (!shell_interrupted && (left = deadline - now_ns()) > 0) {
+    if (event_mode) { /* signals arrive as events, so wait for those */
+      event_wait(0, (left + 999999) / 1000000);
+    } else {
+      struct timespec ts = { left / 1000000000, left % 1000000000 };
+      nanosleep(&ts, NULL); /* cut short by any signal; then recheck */
+      run_deferred();
+    }
+  }
+  return shell_interrupted ? 128 + SIGINT : 0;
+}
+
+/* The builtin table, indexed by bhash */
+static const builtin_t builtins[BUILTIN_SLOTS] = {
+  [0]  = { "printf",   bi_printf,   BI_STAGE },
+  [1]  = { "quit",     bi_quit,     0 },
+  [2]  = { "compgen",  bi_compgen,  BI_STAGE },
+  [3]  = { "export",   bi_export,   0 },
+  [4]  = { "test",     bi_test,     BI_STAGE },
+  [6]  = { "sleep",    bi_sleep,    BI_STAGE },
+  [7]  = { "wait",     bi_wait,     0 },
+  [9]  = { "stats",    bi_stats,    0 },
+  [12] = { "unset",    bi_unset,    0 },
+  [17] = { "setopt",   bi_setopt,   0 },
+  [18] = { "history",  bi_history,  BI_STAGE },
+  [19] = { "&",        bi_amp,      0 },
+  [20] = { "parallel", bi_parallel, 0 },
+  [21] = { "cd",       bi_cd,       0 },
+  [23] = { "bg",       bi_bgfg,     0 },
+  [27] = { "fg",       bi_bgfg,     0 },
+  [41] = { "pwd",      bi_pwd,      BI_STAGE },
+  [44] = { "hash",     bi_hash,     0 },
+  [46] = { "false",    bi_false,    BI_STAGE },
+  [48] = { "echo",     bi_echo,     BI_STAGE },
+  [53] = { "true",     bi_true,     BI_STAGE },
+  [57] = { "jobs",     bi_jobs,     0 },
+  [61] = { "[",        bi_test,     BI_STAGE },
+};
+
+/* initbuiltins - Check that every builtin sits in the slot bhash gives. */
+void initbuiltins(void) {
+  for (int i = 0; i < BUILTIN_SLOTS; i++) {
+    const char* name = builtins[i].name;
+    if (name && bhash(name, strlen(name)) != (unsigned int)i) {
+      printf("initbuiltins: %s is in slot %d, not %u\n", name, i,
+             bhash(name, strlen(name)));
+      exit(1);
+    }
+  }
+}
+
+/* find_builtin - Return the builtin named name, or NULL. */
+const builtin_t* find_builtin(const char* name) {
+  size_t len = strlen(name);
+  if (len == 0) {
+    return NULL;
+  }
+  const builtin_t* b = &builtins[bhash(name, len)];
+  return (b->name && !strcmp(b->name, name)) ? b : NULL;
+}
+
+/*****************
+ * Signal handlers
+ *****************/
+
+//use safe_printf
+
+/* 
+ * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
+ *     a child job terminates (becomes a zombie), or stops because it
+ *     received a SIGSTOP or SIGTSTP signal. The handler should reap
+ *     all available zombie children, but should not wait for any other
+ *     currently running children to terminate.  
+ */
+void sigchld_handler(int sig) { // cleanup
+
+  int status;
+  pid_t pid;
+  struct rusage ru;
+  int saved_errno = errno;
+
+  if (!event_mode) { //launches are left to the main line, see defer_launch
+
+	in_handler = 1;
+  }
+
+  while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED, &ru)) > 0) { //check all children and if any child finishes, then clean a proceess and return its pid
+  //WNOHANG ensures that the child is not already terminated/stopped and WUNTRACED also waits for stopped/suspended children
+  //this signal is blocked by a signal mask in eval in advance so it only reaches this stage at the right time
+
+	reap_status(pid, status, &ru);
+  }
+
+  in_handler = 0;
+  errno = saved_errno;
+  return;
+}
+
+/*
+ * reap_status - Update the job list for a child that wait4 reported
+ *     with the given status and resource usage.
+ */
+void reap_status(pid_t pid, int status, struct rusage* ru) {
+
+  int proc;
+  job_t* job = getjobproc(&jobs, pid, &proc);
+
+  if (!job) { //not one of ours (or already gone)
+
+	return;
+  }
+
+  stage_t* stage = proc < job->nstages ? &job->stages[proc] : NULL;
+
+  if (WIFSTOPPED(status)) { //if stopped. Update state if necessary. don't delete job for this
+
+	if (stage) {
+
+		stage->state = SG_STOPPED;
+	}
+
+	if (job->state != ST) { //report a multi-process job once
+
+		setjobstate(&jobs, job, ST);
+		safe_printf("Job [%d] (%d) stopped by signal %d\n",job->jid,pid,WSTOPSIG(status));
+	}
+	evlog_job("stop", job, pid, "signal", WSTOPSIG(status));
+	return;
+  }
+
+  //otherwise the process is finished (exited or killed by a signal)
+  detachpid(&jobs, pid);
+
+  if (WIFSIGNALED(status)) {
+
+	evlog_job("signal", job, pid, "signal", WTERMSIG(status));
+  }
+
+  else {
+
+	evlog_job("exit", job, pid, "status", WEXITSTATUS(status));
+  }
+
+  add_rusage(&jobs.usage[job->jid - 1], ru);
+
+  if (stage) {
+
+	stage->state = SG_DONE;
+	stage->status = status;
+  }
+
+  //a pipeline is reported once, and a stage whose reader went away is not reported
+  if (WIFSIGNALED(status) && !job->reported
+      && !(stage && WTERMSIG(status) == SIGPIPE && proc < job->nstages - 1)) {
+
+	safe_printf("Job [%d] (%d) terminated by signal %d\n",job->jid,pid, WTERMSIG(status));
+	job->reported = stage != NULL;
+  }
+
+  if (job->batch) { //may start the batch's next items
+
+	batch_reaped(job, proc, status);
+  }
+
+  if (job->nprocs == 0 && !(job->batch && job->batch->refill)) { //the whole job is done
+
+	if (job->nstages > 0) { //a pipeline's status is its last stage's
+
+		status = job->stages[job->nstages - 1].status;
+	}
+	finishjob(job, status);
+	removejob(&jobs, job);
+  }
+
+  if (runq.head) { //a background job may have made room
+
+	admit_queued();
+  }
+}
+
+/*
+ * defer_launch - Called in the SIGCHLD handler instead of starting
+ *     queued jobs or batch items, which takes posix_spawn, malloc and
+ *     stdio: leave it to run_deferred in the main line, as the -e
+ *     event core does, and wake the main line if it waits for input.
+ */
+void defer_launch(void) {
+
+  launch_pending = 1;
+
+  if (wake_pipe[1] >= 0) { //full is fine: a wakeup is already waiting
+
+	int saved_errno = errno;
+	write(wake_pipe[1], "", 1);
+	errno = saved_errno;
+  }
+}
+
+/*
+ * run_deferred - From the main line, start what the SIGCHLD handler
+ *     left: the next items of batches, then queued jobs there is now
+ *     room for. A batch that could start nothing more is finished.
+ */
+void run_deferred(void) {
+
+  sigset_t prev;
+  char drain[64];
+
+  if (!launch_pending) {
+
+	return;
+  }
+
+  block_jobsigs(&prev);
+  launch_pending = 0;
+
+  while (read(wake_pipe[0], drain, sizeof(drain)) > 0) {
+
+	;
+  }
+
+  for (batch_t* b = batches; b; b = b->next_batch) {
+
+	job_t* job = getjobjid(&jobs, b->jid);
+
+	if (!b->refill || !job || job->batch != b) {
+
+		continue;
+	}
+	b->refill = 0;
+	batch_refill(job);
+
+	if (job->nprocs == 0) { //every item left failed to start
+
+		finishjob(job, W_EXITCODE(127, 0));
+		removejob(&jobs, job);
+	}
+  }
+  admit_queued();
+  sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/* 
+ * sigint_handler - The kernel sends a SIGINT to the shell whenever user
+ *    types ctrl-c at the keyboard. Forward it to the foreground job.
+ */
+void sigint_handler(int sig) {
+
+  job_t* job = fgjob(&jobs);
+
+  if (!job) { //a builtin may be waiting, as sleep does
+
+	shell_interrupted = 1;
+  }
+
+  if (job) {
+
+	if (job->batch) { //don't start any more of the batch
+
+		job->batch->cancelled = 1;
+	}
+
+	if (kill(-job->pgid,SIGINT) == -1 && errno != ESRCH) {
+
+		error("kill not working with command using the foreground pid in sigint_handler");
+	}
+  }
+
+  return;
+}
+
+/*
+ * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
+ *     user types ctrl-z at the keyboard. Forward it to the foreground job.
+ */
+void sigtstp_handler(int sig) {
+
+  job_t* job = fgjob(&jobs);
+
+  if (job) {
+
+	if (kill(-job->pgid,SIGTSTP) == -1 && errno != ESRCH) {
+
+		error("kill not working with command using the foreground pid in sigtstp_handler");
+	}
+  }
+
+  return;
+}
+
+/*
+ * sigquit_handler - Terminate the shell on receipt of a SIGQUIT.
+ *    Used by the driver program; do not modify.
+ */
+void sigquit_handler(int sig) {
+  printf("Terminating after receipt of SIGQUIT signal\n");
+  exit(1);
+}
+
+/**************************************
+ * Block arena for job command lines
+ **************************************/
+
+/*
+ * A job's command line lives in a block sized to the line, rounded up
+ * to a power of two, carved from large chunks. A freed block goes on
+ * the free list for its size, found again from the string's length, so
+ * freeing is a few pointer moves and is safe in a signal handler.
+ * Blocks are only taken in the main program with SIGCHLD blocked, and
+ * their memory is reused for later lines rather than returned. A
+ * pipeline job's stage array is a block of the same kind, freed by
+ * the size its stage count gives.
+ */
+
+/* strclass - The size class of a block that can hold len bytes. */
+static int strclass(size_t len) {
+  int c = STR_MINCLASS;
+  while (((size_t)1 << c) < len) {
+    c++;
+  }
+  return c;
+}
+
+/* blockalloc - Take a block of at least size bytes from the arena.
+ *    Returns NULL if memory is exhausted.
+ */
+void* blockalloc(size_t size) {
+  int c = strclass(size);
+  char* block = strings.free[c];
+
+  size = (size_t)1 << c;
+  if (block) {
+    memcpy(&strings.free[c], block, sizeof(char*));
+  } else if (size > STR_CHUNK / 4) { /* too big to carve: a block of its own */
+    if (!(block = malloc(size))) {
+      return NULL;
+    }
+  } else {
+    if (strings.left < size) { /* the rest of the chunk is left unused */
+      if (!(strings.chunk = malloc(STR_CHUNK))) {
+        strings.left = 0;
+        return NULL;
+      }
+      strings.left = STR_CHUNK;
+    }
+    block = strings.chunk;
+    strings.chunk += size;
+    strings.left -= size;
+  }
+  strings.bytes += size;
+  return block;
+}
+
+/* blockfree - Return a block of the given size taken by blockalloc.
+ *    Async-signal-safe.
+ */
+void blockfree(void* block, size_t size) {
+  if (!block) {
+    return;
+  }
+  int c = strclass(size);
+  memcpy(block, &strings.free[c], sizeof(char*));
+  strings.free[c] = block;
+  strings.bytes -= (size_t)1 << c;
+}
+
+/* savestr - Copy s into a block from the arena. Returns NULL if memory
+ *    is exhausted.
+ */
+char* savestr(const char* s) {
+  size_t len = strlen(s) + 1;
+  char* block = blockalloc(len);
+  return block ? memcpy(block, s, len) : NULL;
+}
+
+/* freestr - Return a block taken by savestr. Async-signal-safe. */
+void freestr(char* s) {
+  if (s) {
+    blockfree(s, strlen(s) + 1);
+  }
+}
+
+/***********************************************
+ * Helper routines that manipulate the job list
+ **********************************************/
+
+/*
+ * The job list keeps its slots in a growable array indexed by job ID
+ * (slot jid-1 holds job jid), so lookups by jid, listjobs order, and
+ * jid allocation need no scanning. A separate open-addressed index
+ * (linear probing, power-of-two size) maps every live process of
+ * every job to its jid, and the foreground job is cached. Job IDs are
+ * handed out as maxjid+1 as before; only once every slot up to the
+ * capacity is in use does the table reuse a freed ID from the hole
+ * stack or grow.
+ */
+
+/* block_jobsigs - Block every signal whose handler reads the job list,
+ *    saving the old mask in prev.
+ */
+void block_jobsigs(sigset_t* prev) {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTSTP);
+  sigaddset(&mask, SIGALRM);
+  sigprocmask(SIG_BLOCK, &mask, prev);
+}
+
+/* pidhash - Home bucket of a pid in the pid index. */
+static unsigned int pidhash(joblist_t* jobs, pid_t pid) {
+  return ((unsigned int) pid * 2654435761u) & (jobs->pidcap - 1);
+}
+
+/* pidindex_insert - Record that pid is process proc of job jid. The
+ *    caller has made room with pidindex_reserve.
+ */
+static void pidindex_insert(joblist_t* jobs, pid_t pid, int jid, int proc) {
+  unsigned int i = pidhash(jobs, pid);
+  while (jobs->pidmap[i].pid != 0) {
+    i = (i + 1) & (jobs->pidcap - 1);
+  }
+  jobs->pidmap[i].pid = pid;
+  jobs->pidmap[i].jid = jid;
+  jobs->pidmap[i].proc = proc;
+  jobs->npids++;
+}
+
+/* pidindex_find - Return the bucket holding pid, or -1 if absent. */
+static int pidindex_find(joblist_t* jobs, pid_t pid) {
+  unsigned int i = pidhash(jobs, pid);
+  while (jobs->pidmap[i].pid != 0) {
+    if (jobs->pidmap[i].pid == pid) {
+      return i;
+    }
+    i = (i + 1) & (jobs->pidcap - 1);
+  }
+  return -1;
+}
+
+/* pidindex_remove - Empty bucket i, shifting back later entries of its
+ *    probe run so that no lookup stops early (no tombstones needed).
+ */
+static void pidindex_remove(joblist_t* jobs, unsigned int i) {
+  unsigned int mask = jobs->pidcap - 1;
+  unsigned int j = i;
+  jobs->npids--;
+  while (1) {
+    jobs->pidmap[i].pid = 0;
+    while (1) {
+      j = (j + 1) & mask;
+      if (jobs->pidmap[j].pid == 0) {
+        return;
+      }
+      unsigned int home = pidhash(jobs, jobs->pidmap[j].pid);
+      /* keep j where it is if its home lies cyclically in (i, j] */
+      if ((i < j) ? (i < home && home <= j) : (i < home || home <= j)) {
+        continue;
+      }
+      break;
+    }
+    jobs->pidmap[i] = jobs->pidmap[j];
+    i = j;
+  }
+}
+
+/* pidindex_reserve - Make sure n more pids can be inserted while the
+ *    index stays at most half full, so inserts from signal context
+ *    never need memory. Returns false if memory is exhausted.
+ */
+int pidindex_reserve(joblist_t* jobs, int n) {
+  if ((jobs->npids + n) * 2 <= jobs->pidcap) {
+    return 1;
+  }
+  int newcap = jobs->pidcap;
+  while ((jobs->npids + n) * 2 > newcap) {
+    newcap *= 2;
+  }
+  pident_t* pidmap = calloc(newcap, sizeof(pident_t));
+  if (!pidmap) {
+    return 0;
+  }
+
+  sigset_t prev;
+  block_jobsigs(&prev);
+  pident_t* old = jobs->pidmap;
+  int oldcap = jobs->pidcap;
+  jobs->pidmap = pidmap;
+  jobs->pidcap = newcap;
+  jobs->npids = 0;
+  for (int i = 0; i < oldcap; i++) {
+    if (old[i].pid != 0) {
+      pidindex_insert(jobs, old[i].pid, old[i].jid, old[i].proc);
+    }
+  }
+  sigprocmask(SIG_SETMASK, &prev, NULL);
+  free(old);
+  return 1;
+}
+
+/* growjobs - Double the job table. Signal handlers read the table, so
+ *    they are blocked while the arrays move. Returns false if memory
+ *    is exhausted.
+ */
+static int growjobs(joblist_t* jobs) {
+  sigset_t prev;
+  block_jobsigs(&prev);
+
+  int newcap = jobs->cap * 2;
+  job_t* slots = realloc(jobs->slots, newcap * sizeof(job_t));
+  if (slots) {
+    jobs->slots = slots;
+  }
+  jobusage_t* usage = slots ? realloc(jobs->usage, newcap * sizeof(jobusage_t))
+      : NULL;
+  if (usage) {
+    jobs->usage = usage;
+  }
+  int* holes = usage ? realloc(jobs->holes, newcap * sizeof(int)) : NULL;
+  if (holes) {
+    jobs->holes = holes;
+    for (int i = jobs->cap; i < newcap; i++) {
+      clearjob(&jobs->slots[i]);
+      jobs->slots[i].holed = 0;
+    }
+    jobs->cap = newcap;
+  }
+
+  sigprocmask(SIG_SETMASK, &prev, NULL);
+  return holes != NULL;
+}
+
+/* allocjid - Pick the job ID for a new job: maxjid+1 while it fits,
+ *    then a freed ID below maxjid, and only then grow the table.
+ *    Returns 0 if memory is exhausted.
+ */
+static int allocjid(joblist_t* jobs) {
+  if (jobs->maxjid < jobs->cap) {
+    return jobs->maxjid + 1;
+  }
+  while (jobs->nholes > 0) {
+    int jid = jobs->holes[--jobs->nholes];
+    jobs->slots[jid - 1].holed = 0;
+    if (jid <= jobs->maxjid && jobs->slots[jid - 1].state == UNDEF) {
+      return jid;
+    }
+  }
+  if (!growjobs(jobs)) {
+    return 0;
+  }
+  return jobs->maxjid + 1;
+}
+
+/* clearjob - Clear the entries in a job struct. */
+void clearjob(job_t* job) {
+  job->pid = 0;
+  job->pgid = 0;
+  job->jid = 0;
+  job->state = UNDEF;
+  job->nprocs = 0;
+  job->pidfd = -1;
+  job->batch = NULL;
+  job->timed = 0;
+  job->reported = 0;
+  job->killed = 0;
+  job->awaited = 0;
+  job->deadline = 0;
+  job->token = TOKEN_NONE;
+  job->nstages = 0;
+  job->stages = NULL;
+  job->cmdline = NULL;
+}
 
 /* initjobs - Initialize the job list. */
-void initjobs(job_t* jobs) {
-  for (int i = 0; i < MAXJOBS; i++) {
-    clearjob(&jobs[i]);
+void initjobs(joblist_t* jobs) {
+  jobs->cap = JOBS_INIT;
+  jobs->slots = malloc(jobs->cap * sizeof(job_t));
+  jobs->usage = malloc(jobs->cap * sizeof(jobusage_t));
+  jobs->holes = malloc(jobs->cap * sizeof(int));
+  jobs->pidcap = jobs->cap * 2;
+  jobs->pidmap = calloc(jobs->pidcap, sizeof(pident_t));
+  if (!jobs->slots || !jobs->usage || !jobs->holes || !jobs->pidmap) {
+    error("initjobs: out of memory");
+  }
+  for (int i = 0; i < jobs->cap; i++) {
+    clearjob(&jobs->slots[i]);
+    jobs->slots[i].holed = 0;
+  }
+  jobs->nholes = 0;
+  jobs->nbg = 0;
+  jobs->npids = 0;
+  jobs->maxjid = 0;
+  jobs->fgjid = 0;
+}
+
+/* maxjid - Returns largest allocated job ID */
+int maxjid(joblist_t* jobs) {
+  return jobs->maxjid;
+}
+
+/* takejob - Fill a free slot with a job in the given state, with no
+ *    process yet. Returns the job, or NULL (reported) if memory or the
+ *    pid index is exhausted.
+ */
+job_t* takejob(joblist_t* jobs, int state, char* cmdline) {
+  int jid = allocjid(jobs);
+  char* saved = jid ? savestr(cmdline) : NULL;
+  if (!saved || !pidindex_reserve(jobs, 1)) {
+    freestr(saved);
+    printf("Tried to create too many jobs\n");
+    return NULL;
+  }
+  job_t* job = &jobs->slots[jid - 1];
+  clearjob(job);
+  job->jid = jid;
+  job->cmdline = saved;
+  memset(&jobs->usage[jid - 1], 0, sizeof(jobusage_t));
+  jobs->usage[jid - 1].start_ns = now_ns();
+  if (jid > jobs->maxjid) {
+    jobs->maxjid = jid;
+  }
+  setjobstate(jobs, job, state);
+  return job;
+}
+
+/* joinjob - Give a job taken with takejob its first process, pid,
+ *    which leads the job's process group, as process proc, and move
+ *    the job to state.
+ */
+void joinjob(joblist_t* jobs, job_t* job, pid_t pid, int proc, int state) {
+  job->pid = pid;
+  job->pgid = pid;
+  if (event_mode) {
+    job->pidfd = watchexit(pid);
+  }
+  setjobstate(jobs, job, state); /* only now can ctrl-c find its group */
+  attachpid(jobs, job, pid, proc);
+  if (verbose) {
+    printf("Added job [%d] %d %s", job->jid, job->pid, job->cmdline);
+  }
+}
+
+/* addjob - Add a job to the job list. Return true if
+ *    the job was successfully added or false otherwise.
+ */
+int addjob(joblist_t* jobs, pid_t pid, int state, char* cmdline) {
+  /* pid must be >0 */
+  if (pid < 1) {
+    return 0;
+  }
+  job_t* job = takejob(jobs, state, cmdline);
+  if (!job) {
+    return 0;
+  }
+  joinjob(jobs, job, pid, 0, state);
+  return 1;
+}
+
+/* attachpid - Add process proc, pid, to a job that already has one.
+ *    Safe in signal context once pidindex_reserve has made room.
+ */
+void attachpid(joblist_t* jobs, job_t* job, pid_t pid, int proc) {
+  pidindex_insert(jobs, pid, job->jid, proc);
+  job->nprocs++;
+  evlog_job("spawn", job, pid, NULL, 0);
+}
+
+/* detachpid - Remove a reaped process from its job, which stays in
+ *    the list even if no process is left. Return the job, or NULL if
+ *    pid was not in the list.
+ */
+job_t* detachpid(joblist_t* jobs, pid_t pid) {
+  int i = pidindex_find(jobs, pid);
+  if (i < 0) {
+    return NULL;
+  }
+  job_t* job = &jobs->slots[jobs->pidmap[i].jid - 1];
+  pidindex_remove(jobs, i);
+  job->nprocs--;
+  if (pid == job->pid && job->pidfd >= 0) {
+    close(job->pidfd); /* also leaves the epoll set */
+    job->pidfd = -1;
+  }
+  return job;
+}
+
+/* removejob - Remove a job whose processes have all been detached,
+ *    freeing its command line and returning any jobserver token.
+ *    Async-signal-safe.
+ */
+void removejob(joblist_t* jobs, job_t* job) {
+  int jid = job->jid;
+  if (job->pidfd >= 0) {
+    close(job->pidfd);
+  }
+  freestr(job->cmdline);
+  blockfree(job->stages, job->nstages * sizeof(stage_t));
+  js_release(job->token);
+  jobs->nbg -= job->state == BG;
+  clearjob(job);
+  if (jobs->fgjid == jid) {
+    jobs->fgjid = 0;
+  }
+  if (jid < jobs->maxjid) {
+    if (!job->holed) { /* remember the hole for reuse */
+      job->holed = 1;
+      jobs->holes[jobs->nholes++] = jid;
+    }
+  } else {
+    while (jobs->maxjid > 0 && jobs->slots[jobs->maxjid - 1].state == UNDEF) {
+      jobs->maxjid--;
+    }
+  }
+}
+
+/* deletejob - Delete a job with the given pid from the job list. Return true
+ *    if the job was deleted or false otherwise.
+ */
+int deletejob(joblist_t* jobs, pid_t pid) {
+  /* pid must be >0 */
+  if (pid < 1) {
+    return 0;
+  }
+  job_t* job = detachpid(jobs, pid);
+  if (!job) {
+    return 0; /* no job with the specified pid */
+  }
+  removejob(jobs, job);
+  return 1;
+}
+
+/* setjobstate - Change a job's state, keeping the cached foreground
+ *    job up to date. A pipeline's stopped stages run again once the
+ *    job is continued.
+ */
+void setjobstate(joblist_t* jobs, job_t* job, int state) {
+  int old = job->state;
+  jobs->nbg += (state == BG) - (job->state == BG);
+  job->state = state;
+  if ((state == FG || state == BG) && (old == ST || old == FG || old == BG)
+      && state != old) {
+    evlog_job(old == ST ? "continue" : state == FG ? "fg" : "bg", job, 0,
+              NULL, 0);
+  }
+  if (state != ST) {
+    for (int i = 0; i < job->nstages; i++) {
+      if (job->stages[i].state == SG_STOPPED) {
+        job->stages[i].state = SG_RUNNING;
+      }
+    }
+  }
+  if (state == FG) {
+    jobs->fgjid = job->jid;
+  } else if (jobs->fgjid == job->jid) {
+    jobs->fgjid = 0;
+  }
+}
+
+/* fgjob - Return the current foreground job, or NULL if there is none. */
+job_t* fgjob(joblist_t* jobs) {
+  if (jobs->fgjid == 0) {
+    return NULL;
+  }
+  return &jobs->slots[jobs->fgjid - 1];
+}
+
+/* fgpid - Return PID of current foreground job or 0 if there is no
+ *    foreground job.
+ */
+pid_t fgpid(joblist_t* jobs) {
+  job_t* job = fgjob(jobs);
+  return job ? job->pid : 0;
+}
+
+/* getjobpid - Find a job (by PID of any of its processes) on the job
+ *    list. Return the matching job or NULL if not found.
+ */
+job_t* getjobpid(joblist_t* jobs, pid_t pid) {
+  int proc;
+  return getjobproc(jobs, pid, &proc);
+}
+
+/* getjobproc - Like getjobpid, also storing which of the job's
+ *    processes pid is in *proc.
+ */
+job_t* getjobproc(joblist_t* jobs, pid_t pid, int* proc) {
+  /* pid must be >0 */
+  if (pid < 1) {
+    return NULL;
+  }
+  int i = pidindex_find(jobs, pid);
+  if (i < 0) {
+    return NULL;
+  }
+  *proc = jobs->pidmap[i].proc;
+  return &jobs->slots[jobs->pidmap[i].jid - 1];
+}
+
+/* getjobjid - Find a job (by JID) on the job list. Return the
+ *    matching job or NULL if not found.
+ */
+job_t* getjobjid(joblist_t* jobs, int jid) {
+  /* jid must be >0 */
+  if (jid < 1 || jid > jobs->maxjid) {
+    return NULL;
+  }
+  job_t* job = &jobs->slots[jid - 1];
+  return (job->state != UNDEF) ? job : NULL;
+}
+
+/* pid2jid - Find the job ID of the job with the specified
+ *    process ID. Return 0 if not found.
+ */
+int pid2jid(pid_t pid) {
+  job_t* job = getjobpid(&jobs, pid);
+  return job ? job->jid : 0;
+}
+
+/* listjobs - Print the job list */
+void listjobs(joblist_t* jobs) {
+  for (int jid = 1; jid <= jobs->maxjid; jid++) {
+    job_t* job = &jobs->slots[jid - 1];
+    if (job->state == QU || job->state == WA) {
+      printf("[%d] (-) %s %s", job->jid,
+             job->state == WA ? "Waiting" : "Queued", job->cmdline);
+    } else if (job->state != UNDEF) {
+      printf("[%d] (%d) ", job->jid, job->pid);
+      switch (job->state) {
+        case BG: 
+          printf("Running ");
+          break;
+        case FG: 
+          printf("Foreground ");
+          break;
+        case ST: 
+          printf("Stopped ");
+          break;
+        default:
+          printf("listjobs: Internal error: job[%d].state=%d ", 
+              jid, job->state);
+          break;
+      }
+      printf("%s", job->cmdline);
+    }
+  }
+}
+
+/***********************
+ * Resource accounting
+ ***********************/
+
+/*
+ * Children are reaped with wait4, and the rusage of each finished
+ * process is added to its job. When the job's last process is reaped
+ * the job's record is copied into a small ring of recently finished
+ * jobs, which jobs -l shows. All of this runs in the reap path, so it
+ * sticks to plain arithmetic, memcpy and clock_gettime.
+ */
+
+/* now_ns - Current CLOCK_MONOTONIC time in nanoseconds. */
+long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* add_rusage - Add a reaped process's resource usage to its job's. */
+void add_rusage(jobusage_t* u, struct rusage* ru) {
+  u->utime_us += ru->ru_utime.tv_sec * 1000000LL + ru->ru_utime.tv_usec;
+  u->stime_us += ru->ru_stime.tv_sec * 1000000LL + ru->ru_stime.tv_usec;
+  if (ru->ru_maxrss > u->maxrss_kb) {
+    u->maxrss_kb = ru->ru_maxrss;
+  }
+  u->nvcsw += ru->ru_nvcsw;
+  u->nivcsw += ru->ru_nivcsw;
+}
+
+/* sample_usage - Add the usage so far of a live (e.g. stopped) process,
+ *    read from /proc, since wait4 only reports on finished ones.
+ */
+static void sample_usage(pid_t pid, jobusage_t* u) {
+  char name[64], buf[1024];
+  snprintf(name, sizeof(name), "/proc/%d/stat", pid);
+  FILE* f = fopen(name, "r");
+  if (f) {
+    unsigned long utime, stime;
+    /* fields 14 and 15 follow the parenthesized command name */
+    if (fgets(buf, sizeof(buf), f) && strrchr(buf, ')')
+        && sscanf(strrchr(buf, ')') + 2,
+                  "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                  &utime, &stime) == 2) {
+      long tick_us = 1000000L / sysconf(_SC_CLK_TCK);
+      u->utime_us += utime * tick_us;
+      u->stime_us += stime * tick_us;
+    }
+    fclose(f);
+  }
+  snprintf(name, sizeof(name), "/proc/%d/status", pid);
+  if ((f = fopen(name, "r"))) {
+    long val;
+    while (fgets(buf, sizeof(buf), f)) {
+      if (sscanf(buf, "VmHWM: %ld", &val) == 1 && val > u->maxrss_kb) {
+        u->maxrss_kb = val;
+      } else if (sscanf(buf, "voluntary_ctxt_switches: %ld", &val) == 1) {
+        u->nvcsw += val;
+      } else if (sscanf(buf, "nonvoluntary_ctxt_switches: %ld", &val) == 1) {
+        u->nivcsw += val;
+      }
+    }
+    fclose(f);
+  }
+}
+
+/* finishjob - Record a job whose last process was just reaped in the
+ *    ring of finished jobs, which takes over its command line, and
+ *    report its usage if it was run by time.
+ */
+void finishjob(job_t* job, int status) {
+  jobusage_t* u = &jobs.usage[job->jid - 1];
+  u->end_ns = now_ns();
+  done_t* d = &donelog[ndone++ % DONE_HISTORY];
+  freestr(d->cmdline); /* the entry it replaces */
+  d->jid = job->jid;
+  d->pid = job->pid;
+  d->status = status;
+  d->usage = *u;
+  d->cmdline = job->cmdline;
+  job->cmdline = NULL;
+  if (job->timed) {
+    report_usage(u);
+  }
+  if (job->awaited) {
+    after_finished(job, status);
+  }
+}
+
+/* report_usage - Print a job's usage the way the time builtin does. */
+void report_usage(jobusage_t* u) {
+  long long real_ms = (u->end_ns - u->start_ns) / 1000000;
+  safe_printf("real\t%lld.%03llds\nuser\t%lld.%03llds\nsys\t%lld.%03llds\n",
+              real_ms / 1000, real_ms % 1000,
+              u->utime_us / 1000000, u->utime_us / 1000 % 1000,
+              u->stime_us / 1000000, u->stime_us / 1000 % 1000);
+  safe_printf("maxrss\t%ld KB\nctxsw\t%ld voluntary, %ld involuntary\n",
+              u->maxrss_kb, u->nvcsw, u->nivcsw);
+}
+
+/* time_builtin - Run a builtin and report the shell's own usage over it. */
+void time_builtin(char** argv) {
+  struct rusage before, after;
+  jobusage_t u;
+  memset(&u, 0, sizeof(u));
+
+  getrusage(RUSAGE_SELF, &before);
+  u.start_ns = now_ns();
+  builtin_cmd(argv);
+  u.end_ns = now_ns();
+  getrusage(RUSAGE_SELF, &after);
+
+  u.utime_us = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) * 1000000LL
+    + after.ru_utime.tv_usec - before.ru_utime.tv_usec;
+  u.stime_us = (after.ru_stime.tv_sec - before.ru_stime.tv_sec) * 1000000LL
+    + after.ru_stime.tv_usec - before.ru_stime.tv_usec;
+  u.maxrss_kb = after.ru_maxrss;
+  u.nvcsw = after.ru_nvcsw - before.ru_nvcsw;
+  u.nivcsw = after.ru_nivcsw - before.ru_nivcsw;
+  report_usage(&u);
+}
+
+/* print_usage_line - One indented line of usage for jobs -l. */
+static void print_usage_line(jobusage_t* u) {
+  long long end = u->end_ns ? u->end_ns : now_ns();
+  long long wall_ms = (end - u->start_ns) / 1000000;
+  printf("        wall %lld.%03llds  user %lld.%03llds  sys %lld.%03llds"
+         "  maxrss %ld KB  ctxsw %ld+%ld\n",
+         wall_ms / 1000, wall_ms % 1000,
+         u->utime_us / 1000000, u->utime_us / 1000 % 1000,
+         u->stime_us / 1000000, u->stime_us / 1000 % 1000,
+         u->maxrss_kb, u->nvcsw, u->nivcsw);
+}
+
+/* print_stages - One indented line with each stage of a pipeline job
+ *    for jobs -l: its pid (0 for a builtin) and its state.
+ */
+static void print_stages(job_t* job) {
+  printf("       ");
+  for (int i = 0; i < job->nstages; i++) {
+    stage_t* stage = &job->stages[i];
+    printf(" %s%d ", i > 0 ? "| " : "", stage->pid);
+    if (stage->state == SG_RUNNING) {
+      printf("Running");
+    } else if (stage->state == SG_STOPPED) {
+      printf("Stopped");
+    } else if (WIFSIGNALED(stage->status)) {
+      printf("signal %d", WTERMSIG(stage->status));
+    } else {
+      printf("exit %d", WEXITSTATUS(stage->status));
+    }
+  }
+  printf("\n");
+}
+
+/*
+ * listjobs_long - jobs -l: the job list plus the usage of stopped jobs,
+ *    followed by the most recently finished jobs and their usage.
+ */
+void listjobs_long(joblist_t* jobs) {
+  sigset_t mask, prev;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, &prev);
+
+  for (int jid = 1; jid <= jobs->maxjid; jid++) {
+    job_t* job = &jobs->slots[jid - 1];
+    if (job->state == UNDEF) {
+      continue;
+    }
+    printf("[%d] (%d) %s %s", job->jid, job->pid,
+           job->state == ST ? "Stopped" : job->state == QU ? "Queued"
+           : job->state == WA ? "Waiting" : "Running", job->cmdline);
+    if (job->nstages > 0) {
+      print_stages(job);
+    }
+    if (job->state == ST) {
+      jobusage_t u = jobs->usage[jid - 1];
+      if (getjobpid(jobs, job->pid) == job) { /* first process not reaped */
+        sample_usage(job->pid, &u);
+      }
+      print_usage_line(&u);
+    }
+  }
+
+  int first = ndone > DONE_HISTORY ? ndone - DONE_HISTORY : 0;
+  for (int i = first; i < ndone; i++) {
+    done_t* d = &donelog[i % DONE_HISTORY];
+    if (WIFSIGNALED(d->status)) {
+      printf("Done [%d] (%d) signal %d %s", d->jid, d->pid,
+             WTERMSIG(d->status), d->cmdline);
+    } else {
+      printf("Done [%d] (%d) exit %d %s", d->jid, d->pid,
+             WEXITSTATUS(d->status), d->cmdline);
+    }
+    print_usage_line(&d->usage);
+  }
+
+  sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/**********************
+ * Latency statistics
+ **********************/
+
+/*
+ * Each phase of running a command has a histogram of its latencies in
+ * nanoseconds. Buckets are log-scale with HIST_SUB sub-buckets per
+ * power of two, so a sample costs a clock read, a count-leading-zeros
+ * and an increment, and percentiles are accurate to about 1/HIST_SUB of
+ * their value. Recording does no allocation and is safe in a handler.
+ */
+
+static const char* phase_names[NPHASES] = {
+  "parse", "lookup", "fork", "setpgid", "exec", "addjob", "waitfg"
+};
+
+/* hist_bucket - The bucket a latency of ns nanoseconds falls in. */
+static int hist_bucket(unsigned long long ns) {
+  if (ns < HIST_SUB) {
+    return ns;
+  }
+  int exp = 63 - __builtin_clzll(ns);           /* ns >= 2^exp */
+  int sub = (ns >> (exp - HIST_SUBBITS)) & (HIST_SUB - 1);
+  return (exp - HIST_SUBBITS + 1) * HIST_SUB + sub;
+}
+
+/* hist_upper - The largest latency that falls in bucket b. */
+static unsigned long long hist_upper(int b) {
+  if (b < HIST_SUB) {
+    return b;
+  }
+  int exp = b / HIST_SUB + HIST_SUBBITS - 1;
+  unsigned long long sub = b % HIST_SUB;
+  return ((HIST_SUB + sub + 1) << (exp - HIST_SUBBITS)) - 1;
+}
+
+/* stat_record - Add one latency, from start to now, to a phase. */
+void stat_record(int phase, long long start) {
+  long long ns = now_ns() - start;
+  hist_t* h = &stats[phase];
+  if (ns < 0) {
+    ns = 0;
+  }
+  h->buckets[hist_bucket(ns)]++;
+  h->count++;
+  h->sum_ns += ns;
+  if (ns > h->max_ns) {
+    h->max_ns = ns;
+  }
+}
+
+/* hist_percentile - The latency below which fraction p of samples fall. */
+static unsigned long long hist_percentile(hist_t* h, double p) {
+  unsigned long rank = (unsigned long)(p * h->count);
+  unsigned long seen = 0;
+  if (rank >= h->count) {
+    rank = h->count - 1;
+  }
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen > rank) {
+      unsigned long long upper = hist_upper(b);
+      return upper < (unsigned long long)h->max_ns ? upper : h->max_ns;
+    }
+  }
+  return h->max_ns;
+}
+
+/*
+ * print_stats - Print count and percentiles, in microseconds, for each
+ *    phase that has samples. With the posix_spawn launch path, fork and
+ *    exec happen in one call that returns once the child has exec'd, so
+ *    it is recorded under exec; fork and setpgid come from the -F path.
+ */
+void print_stats(void) {
+  printf("%-8s %8s %10s %10s %10s %10s %10s\n", "phase/us", "count",
+         "mean", "p50", "p90", "p99", "max");
+  for (int i = 0; i < NPHASES; i++) {
+    hist_t* h = &stats[i];
+    if (h->count == 0) {
+      printf("%-8s %8d %10s %10s %10s %10s %10s\n", phase_names[i], 0,
+             "-", "-", "-", "-", "-");
+      continue;
+    }
+    printf("%-8s %8lu %10.1f %10.1f %10.1f %10.1f %10.1f\n", phase_names[i],
+           h->count, h->sum_ns / 1e3 / h->count,
+           hist_percentile(h, 0.50) / 1e3, hist_percentile(h, 0.90) / 1e3,
+           hist_percentile(h, 0.99) / 1e3, h->max_ns / 1e3);
+  }
+}
+
+/* do_stats - The stats builtin: print the histograms, then reset them. */
+void do_stats(void) {
+  sigset_t mask, prev;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, &prev); /* a handler may be recording */
+  print_stats();
+  memset(stats, 0, sizeof(stats));
+  sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/****************************
+ * Background admission queue
+ ****************************/
+
+/*
+ * With setopt maxjobs N, at most N background jobs run at once. A
+ * background command started beyond that still gets a job, in state
+ * QU, and waits in FIFO order with its resolved path, arguments and
+ * open redirections kept in one block from the arena. Whenever the
+ * reap path sees fewer than N background jobs running, it starts the
+ * oldest queued one, so a burst of & commands is throttled instead of
+ * being dropped or oversubscribing the machine. In signal mode the
+ * reap path is sigchld_handler, which only notes that there may be
+ * room (defer_launch); the main line starts the jobs in run_deferred,
+ * at its next wait or before it reads the next command.
+ */
+
+/* queue_full - Should a new background command wait in the queue? */
+int queue_full(void) {
+  return runq.starved
+      || (runq.maxjobs > 0 && (runq.head || jobs.nbg >= runq.maxjobs));
+}
+
+/*
+ * enqueue - Queue a background command, taking over its redirection
+ *    descriptors, and report its job. If the line has an after prefix,
+ *    the job instead waits, in state WA, for the jobs it names. Returns
+ *    false, with nothing queued and fds still the caller's, if memory
+ *    is exhausted. SIGCHLD is blocked.
+ */
+int enqueue(char* path, char** argv, char** env, int nenv, int fds[3],
+            int errdup, char* cmdline, int timed, long long limit) {
+  int argc = 0;
+  size_t size = sizeof(queued_t) + strlen(path) + 1 + after.n * sizeof(int);
+  for (; argv[argc]; argc++) {
+    size += sizeof(char*) + strlen(argv[argc]) + 1;
+  }
+  size += sizeof(char*);
+  for (int i = 0; i < nenv; i++) {
+    size += sizeof(char*) + strlen(env[i]) + 1;
+  }
+
+  queued_t* q = env_reserve(nenv) ? blockalloc(size) : NULL;
+  job_t* job = q ? takejob(&jobs, after.n ? WA : QU, cmdline) : NULL;
+  if (!job || !pidindex_reserve(&jobs, runq.n + 1)) {
+    if (job) {
+      removejob(&jobs, job);
+    }
+    blockfree(q, size);
+    return 0;
+  }
+
+  /* the argv and env arrays, the jobs it runs after, then the strings
+     follow the header */
+  q->argv = (char**) (q + 1);
+  q->env = q->argv + argc + 1;
+  q->nenv = nenv;
+  q->deps = (int*) (q->env + nenv);
+  q->ndeps = after.n;
+  if (after.n) { /* after.jids is NULL until the first after */
+    memcpy(q->deps, after.jids, after.n * sizeof(int));
+  }
+  char* p = (char*) (q->deps + after.n);
+  for (int i = 0; i < argc; i++) {
+    q->argv[i] = strcpy(p, argv[i]);
+    p += strlen(p) + 1;
+  }
+  q->argv[argc] = NULL;
+  for (int i = 0; i < nenv; i++) {
+    q->env[i] = strcpy(p, env[i]);
+    p += strlen(p) + 1;
+  }
+  q->path = strcpy(p, path);
+  memcpy(q->fds, fds, sizeof(q->fds));
+  q->errdup = errdup;
+  q->size = size;
+  q->jid = job->jid;
+  q->next = NULL;
+  if (q->ndeps > 0) {
+    for (int i = 0; i < q->ndeps; i++) {
+      jobs.slots[q->deps[i] - 1].awaited |= AW_AFTER;
+    }
+    q->next = runq.waiting;
+    runq.waiting = q;
+  } else {
+    if (runq.tail) {
+      runq.tail->next = q;
+    } else {
+      runq.head = q;
+    }
+    runq.tail = q;
+  }
+  runq.n++;
+
+  job->timed = timed;
+  if ((job->deadline = limit)) { /* armed when it starts */
+    wd.pending++;
+  }
+  printf("[%d] (-) %s %s", job->jid, q->ndeps ? "Waiting" : "Queued",
+         job->cmdline);
+  return 1;
+}
+
+/* dequeue - Unlink job jid's entry from the queue and return it. */
+static queued_t* dequeue(int jid) {
+  queued_t** link = &runq.head;
+  queued_t* prev = NULL;
+  while (*link && (*link)->jid != jid) {
+    prev = *link;
+    link = &prev->next;
+  }
+  queued_t* q = *link;
+  if (q) {
+    *link = q->next;
+    if (runq.tail == q) {
+      runq.tail = prev;
+    }
+    runq.n--;
+  }
+  return q;
+}
+
+/*
+ * start_queued - Start a queued job in the given state (BG, or FG for
+ *    fg), holding the jobserver token given. Returns true if its
+ *    process is running; if it could not be started, the token is
+ *    given back and the job is finished with status 127 and removed.
+ *    Runs in the main line with SIGCHLD blocked.
+ */
+int start_queued(job_t* job, int state, int token) {
+  queued_t* q = dequeue(job->jid);
+  long long limit = job->deadline;
+  int errfd = !q->errdup ? q->fds[2] : q->fds[1] >= 0 ? q->fds[1]
+            : STDOUT_FILENO;
+  pid_t pid = launch(q->path, q->argv, q->env, q->nenv, 0, q->fds[0],
+                     q->fds[1], errfd);
+
+  for (int fd = 0; fd < 3; fd++) {
+    if (q->fds[fd] >= 0) {
+      close(q->fds[fd]);
+    }
+  }
+  blockfree(q, q->size);
+  if (limit) {
+    wd.pending--; /* its heap slot is now spare, or in use below */
+    job->deadline = 0;
+  }
+
+  if (pid == 0) {
+    js_release(token);
+    finishjob(job, W_EXITCODE(127, 0));
+    removejob(&jobs, job);
+    return 0;
+  }
+  job->pid = pid;
+  job->pgid = pid;
+  job->token = token; /* returned when the job is removed */
+  jobs.usage[job->jid - 1].start_ns = now_ns();
+  if (event_mode) {
+    job->pidfd = watchexit(pid);
+  }
+  attachpid(&jobs, job, pid, 0);
+  setjobstate(&jobs, job, state);
+  watchdog_arm(job, limit);
+  return 1;
+}
+
+/* run_queued - start_queued from the main program, for fg and bg. A
+ *    job put in the background waits for a jobserver token, as an &
+ *    command does; if ctrl-c ends the wait, it stays queued.
+ */
+int run_queued(job_t* job, int state) {
+  sigset_t mask, prev;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, &prev);
+  int token = state == BG ? js_acquire(&prev) : TOKEN_NONE;
+  int started = 0;
+  if (token == TOKEN_INTR) {
+    printf("[%d] still queued\n", job->jid);
+  } else {
+    started = start_queued(job, state, token);
+  }
+  sigprocmask(SIG_SETMASK, &prev, NULL);
+  return started;
+}
+
+/* admit_queued - Start queued jobs while there is room and a jobserver
+ *    token for each, wherever either may have come free; in the
+ *    SIGCHLD handler, leave it to the main line. If the head must wait
+ *    for a token, the main line watches the jobserver for one.
+ */
+void admit_queued(void) {
+  if (in_handler) {
+    defer_launch();
+    return;
+  }
+  runq.starved = 0;
+  while (runq.head && (runq.maxjobs == 0 || jobs.nbg < runq.maxjobs)) {
+    int token = js_try();
+    if (token == TOKEN_BUSY) {
+      runq.starved = 1;
+      js_watch();
+      break;
+    }
+    start_queued(&jobs.slots[runq.head->jid - 1], BG, token);
+  }
+}
+
+/*
+ * do_setopt - setopt [maxjobs N | jobserver N | edit on|off]: show
+ *    or set the shell's options. maxjobs 0 means no limit; jobserver N
+ *    makes the shell a jobserver with N tokens for its & jobs and
+ *    children; edit turns the line editor on or off on a terminal.
+ */
+void do_setopt(char** argv) {
+  if (!argv[1]) {
+    printf("maxjobs %d\n", runq.maxjobs);
+    if (js.own) {
+      printf("jobserver %d\n", js.size);
+    } else {
+      printf("jobserver %s\n", js.rfd >= 0 ? "make" : "off");
+    }
+    printf("edit %s\n", edit_mode ? "on" : "off");
+    return;
+  }
+  if (!strcmp(argv[1], "edit") && argv[2] && !argv[3]
+      && (!strcmp(argv[2], "on") || !strcmp(argv[2], "off"))) {
+    if (argv[2][1] == 'n' && !edit_ok) {
+      printf("setopt: edit needs a terminal\n");
+      return;
+    }
+    edit_mode = argv[2][1] == 'n';
+    return;
+  }
+  char* end;
+  long n = argv[2] ? strtol(argv[2], &end, 10) : -1;
+  if (n < 0 || argv[3] || *end || n > INT_MAX) {
+    printf("usage: setopt [maxjobs N | jobserver N | edit on|off]\n");
+    return;
+  }
+  if (!strcmp(argv[1], "jobserver")) {
+    if (n < 1 || !js_create(n)) {
+      printf("setopt: %s\n", n < 1 ? "jobserver needs at least 1 token"
+             : "already using a jobserver");
+    }
+    return;
+  }
+  if (strcmp(argv[1], "maxjobs")) {
+    printf("usage: setopt [maxjobs N | jobserver N | edit on|off]\n");
+    return;
+  }
+
+  sigset_t mask, prev;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, &prev);
+  runq.maxjobs = n;
+  admit_queued(); /* a higher limit makes room at once */
+  sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*****************
+ * Job dependencies
+ *****************/
+
+/*
+ * after %j ... cmd & starts cmd once every job it names has exited
+ * with status 0, and never if one of them fails. Until then its job
+ * waits in state WA, prepared as a queued job is, on a list of its
+ * own; the jobs it waits for are marked AW_AFTER, and when one of them
+ * finishes, the reap path crosses it off, moving the waiting job to
+ * the admission queue once nothing is left, or cancelling it (and so
+ * whatever waits for it in turn) if it failed. In the foreground, and
+ * for builtins and pipelines, after instead waits in the shell as wait
+ * does, then runs the command if all went well.
+ *
+ * wait [-n] [%j ...] blocks until the jobs named, or all background
+ * jobs, have finished, or with -n until the first of them has. The
+ * jobs are marked AW_WAIT and counted, and the reap path counts them
+ * down, so the shell sleeps until a child changes state and then
+ * checks one counter, never scanning the job list.
+ */
+
+/* done_status - The wait status of the last finished job jid still in
+ *    the finished-job log. Returns false if there is none.
+ */
+static int done_status(int jid, int* status) {
+  int n = ndone < DONE_HISTORY ? ndone : DONE_HISTORY;
+  for (int i = 1; i <= n; i++) {
+    done_t* d = &donelog[(ndone - i) % DONE_HISTORY];
+    if (d->jid == jid) {
+      *status = d->status;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* succeeded - Did a job that finished with this wait status succeed? */
+static int succeeded(int status) {
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/*
+ * after_prefix - Take the jobs of an after %j ... prefix from the
+ *    front of a command's words into after. Returns the number of
+ *    words taken, 0 if there is no prefix, or -1 (reported) if it is
+ *    malformed.
+ */
+int after_prefix(char** argv) {
+  int i = 1;
+  after.n = 0;
+  if (strcmp(argv[0], "after")) {
+    return 0;
+  }
+  for (; argv[i] && argv[i][0] == '%'; i++) {
+    int jid = atoi(&argv[i][1]);
+    if (jid <= 0) {
+      printf("after: %s: No such job\n", argv[i]);
+      return -1;
+    }
+    if (after.n == after.cap) {
+      int cap = after.cap ? after.cap * 2 : 8;
+      int* jids = realloc(after.jids, cap * sizeof(int));
+      if (!jids) {
+        printf("after: out of memory\n");
+        return -1;
+      }
+      after.jids = jids;
+      after.cap = cap;
+    }
+    after.jids[after.n++] = jid;
+  }
+  if (i == 1 || !argv[i]) {
+    printf("usage: after %%job ... command\n");
+    return -1;
+  }
+  return i;
+}
+
+/*
+ * after_pending - Drop the jobs in after that have already succeeded,
+ *    leaving those still to finish. Returns false (reported) if one of
+ *    them failed or is unknown. SIGCHLD is blocked.
+ */
+int after_pending(void) {
+  int status;
+  for (int i = 0; i < after.n; ) {
+    int jid = after.jids[i];
+    if (getjobjid(&jobs, jid)) {
+      i++;
+    } else if (!done_status(jid, &status)) {
+      printf("after: %%%d: No such job\n", jid);
+      return 0;
+    } else if (!succeeded(status)) {
+      printf("after: [%d] failed\n", jid);
+      return 0;
+    } else {
+      after.jids[i] = after.jids[--after.n];
+    }
+  }
+  return 1;
+}
+
+/* cancel_waiting - Give up on a waiting job, one of whose jobs failed.
+ *    Async-signal-safe; runs in the reap path.
+ */
+static void cancel_waiting(queued_t* q, int failed) {
+  job_t* job = &jobs.slots[q->jid - 1];
+  for (int fd = 0; fd < 3; fd++) {
+    if (q->fds[fd] >= 0) {
+      close(q->fds[fd]);
+    }
+  }
+  blockfree(q, q->size);
+  runq.n--;
+  if (job->deadline) {
+    wd.pending--;
+  }
+  safe_printf("Job [%d] (-) not started: job [%d] failed\n", job->jid, failed);
+  finishjob(job, W_EXITCODE(127, 0)); /* fails what waits for it, too */
+  removejob(&jobs, job);
+}
+
+/* release_waiting - Cross job jid, which finished, off what the
+ *    waiting jobs wait for, and queue or cancel those it affects.
+ */
+static void release_waiting(int jid, int ok) {
+  int moved = 0;
+  queued_t** link = &runq.waiting;
+  while (*link) {
+    queued_t* q = *link;
+    int k = 0;
+    while (k < q->ndeps && q->deps[k] != jid) {
+      k++;
+    }
+    if (k == q->ndeps) {
+      link = &q->next;
+      continue;
+    }
+    *link = q->next;
+    if (!ok) {
+      cancel_waiting(q, jid);
+      link = &runq.waiting; /* the cancel may have unlinked others */
+      continue;
+    }
+    q->deps[k] = q->deps[--q->ndeps];
+    if (q->ndeps > 0) {
+      *link = q; /* still waiting */
+      link = &q->next;
+      continue;
+    }
+    q->next = NULL; /* ready: to the back of the admission queue */
+    if (runq.tail) {
+      runq.tail->next = q;
+    } else {
+      runq.head = q;
+    }
+    runq.tail = q;
+    setjobstate(&jobs, &jobs.slots[q->jid - 1], QU);
+    moved = 1;
+  }
+  if (moved) {
+    admit_queued();
+  }
+}
+
+/*
+ * after_finished - Tell whatever is waiting for a job that it has
+ *    finished with the given wait status. Called by finishjob for a
+ *    job marked awaited; async-signal-safe.
+ */
+void after_finished(job_t* job, int status) {
+  int awaited = job->awaited;
+  job->awaited = 0;
+  if (awaited & AW_WAIT) {
+    waitset.left--;
+    if (waitset.done++ == 0 && waitset.any) {
+      waitset.status = status;
+    }
+    if (job->jid == waitset.lastjid) {
+      waitset.status = status;
+    }
+    if (!succeeded(status) && !waitset.failed) {
+      waitset.failed = job->jid;
+    }
+  }
+  if (awaited & AW_AFTER) {
+    release_waiting(job->jid, succeeded(status));
+  }
+}
+
+/*
+ * wait_jobs - Wait until the n jobs jids (with jids NULL, every job
+ *    running or held in the background) have finished, or with any set
+ *    until one has. Returns the exit status of the last job named, of
+ *    the first to finish with any, or 0 for all jobs; 127 if a job is
+ *    unknown, and 128+SIGINT on ctrl-c. waitset.failed is then a job
+ *    that finished without succeeding, if any.
+ */
+int wait_jobs(int* jids, int n, int any) {
+  sigset_t prev, empty;
+  int status = 0, unknown = 0;
+  block_jobsigs(&prev);
+  memset(&waitset, 0, sizeof(waitset));
+  waitset.any = any;
+
+  if (!jids) {
+    n = jobs.maxjid;
+  }
+  for (int i = 0; i < n; i++) {
+    int jid = jids ? jids[i] : i + 1;
+    job_t* job = getjobjid(&jobs, jid);
+    if (jids && i == n - 1 && !any) {
+      waitset.lastjid = jid;
+    }
+    if (job && (jids || job->state == BG || job->state == QU
+                || job->state == WA)) {
+      if (!(job->awaited & AW_WAIT)) {
+        job->awaited |= AW_WAIT;
+        waitset.left++;
+      }
+    } else if (jids && done_status(jid, &status)) {
+      waitset.done++; /* already finished */
+      if (!succeeded(status) && !waitset.failed) {
+        waitset.failed = jid;
+      }
+      if (jid == waitset.lastjid || (any && waitset.done == 1)) {
+        waitset.status = status;
+      }
+    } else if (jids) {
+      printf("%%%d: No such job\n", jid);
+      unknown = 1;
+    }
+  }
+
+  sigemptyset(&empty);
+  shell_interrupted = 0;
+  while (waitset.left > 0 && !(any && waitset.done > 0)
+         && !shell_interrupted) {
+    if (event_mode) {
+      event_wait(0, -1);
+    } else {
+      sigsuspend(&empty);
+      run_deferred();
+    }
+  }
+
+  if (waitset.left > 0) { /* not all finished: stop telling us */
+    for (int jid = 1; jid <= jobs.maxjid; jid++) {
+      jobs.slots[jid - 1].awaited &= ~AW_WAIT;
+    }
+  }
+  status = waitset.status;
+  sigprocmask(SIG_SETMASK, &prev, NULL);
+
+  if (shell_interrupted) {
+    return 128 + SIGINT;
+  }
+  if (unknown && !(any && waitset.done > 0)) {
+    return 127;
+  }
+  return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+/*
+ * do_wait - wait [-n] [%jobid ...]: wait for the jobs given, or for
+ *    all background jobs, or with -n for the first of them to finish.
+ */
+int do_wait(char** argv) {
+  int any = argv[1] && !strcmp(argv[1], "-n");
+  char** args = argv + 1 + any;
+  int n = 0;
+  while (args[n]) {
+    n++;
+  }
+  if (n == 0) {
+    return wait_jobs(NULL, 0, any);
+  }
+
+  int jids[n];
+  for (int i = 0; i < n; i++) {
+    if (args[i][0] != '%' || (jids[i] = atoi(&args[i][1])) <= 0) {
+      printf("wait: %s: argument must be a %%jobid\n", args[i]);
+      return 2;
+    }
+  }
+  return wait_jobs(jids, n, any);
+}
+
+/********************
+ * GNU make jobserver
+ ********************/
+
+/*
+ * Under make -jN, MAKEFLAGS names make's jobserver: a pipe (R,W) or a
+ * named fifo holding N-1 one-byte tokens, with one more implicit in
+ * every job make starts. The shell takes a token for each background
+ * job it launches with &, waiting for one if none is free, and the job
+ * gives it back when it is removed in the reap path, so everything
+ * under one make shares its core budget. The implicit token goes to
+ * the first background job. setopt jobserver N makes the shell a
+ * jobserver of its own, passed to children through MAKEFLAGS, so a
+ * make or a nested bsh that it runs shares the shell's budget. Jobs
+ * the admission queue starts, after jobs among them, take a token too,
+ * and stay queued while none is free; the shell then watches the
+ * jobserver, as well as its own jobs, for one coming back. parallel
+ * runs one item on the shell's own slot, like any foreground command,
+ * and each more at once on a token.
+ */
+
+/* js_open - Use the tokens in rfd, reading them through a nonblocking
+ *    description of its own so that a make sharing the pipe is not
+ *    affected, and returning them to wfd.
+ */
+static void js_open(int rfd, int wfd) {
+  char name[64];
+  snprintf(name, sizeof(name), "/proc/self/fd/%d", rfd);
+  js.rfd = open(name, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  js.wfd = js.rfd >= 0 ? wfd : -1;
+}
+
+/* initjobserver - Join the jobserver MAKEFLAGS names, if any. */
+void initjobserver(void) {
+  const char* flags = env_get("MAKEFLAGS");
+  const char* auth = NULL;
+  const char* p;
+  for (p = flags; p && (p = strstr(p, "--jobserver-")); p++) {
+    if (!strncmp(p, "--jobserver-auth=", 17)) {
+      auth = p + 17;
+    } else if (!strncmp(p, "--jobserver-fds=", 16)) { /* make before 4.2 */
+      auth = p + 16;
+    }
+  }
+  if (!auth) {
+    return;
+  }
+
+  int rfd, wfd;
+  if (!strncmp(auth, "fifo:", 5)) {
+    char path[PATH_MAX];
+    size_t len = strcspn(auth + 5, " ");
+    if (len >= sizeof(path)) {
+      return;
+    }
+    memcpy(path, auth + 5, len);
+    path[len] = '\0';
+    js.rfd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    js.wfd = js.rfd >= 0 ? open(path, O_WRONLY | O_CLOEXEC) : -1;
+  } else if (sscanf(auth, "%d,%d", &rfd, &wfd) == 2
+             && fcntl(rfd, F_GETFD) >= 0 && fcntl(wfd, F_GETFD) >= 0) {
+    js_open(rfd, wfd);
+  } /* else make did not pass the fds on: run without */
+  if (js.rfd < 0 || js.wfd < 0) {
+    js.rfd = js.wfd = -1;
+  }
+}
+
+/*
+ * js_try - Take a jobserver token if one is free, without waiting.
+ *    Returns the token, TOKEN_NONE if there is no jobserver (or it
+ *    broke), or TOKEN_BUSY if every token is in use.
+ */
+int js_try(void) {
+  unsigned char c;
+  if (js.rfd < 0) {
+    return TOKEN_NONE;
+  }
+  if (js.implicit) {
+    js.implicit = 0;
+    return TOKEN_IMPLICIT;
+  }
+  ssize_t n = read(js.rfd, &c, 1);
+  if (n == 1) {
+    return c;
+  }
+  return n < 0 && (errno == EAGAIN || errno == EINTR) ? TOKEN_BUSY
+      : TOKEN_NONE;
+}
+
+/* js_watch - With -e, have the event loop report, once, that the
+ *    jobserver has a token to take; without -e, input_wait polls it
+ *    while the admission queue is starved.
+ */
+void js_watch(void) {
+  static int added;
+  struct epoll_event ev;
+  if (!event_mode || js.rfd < 0) {
+    return;
+  }
+  ev.events = EPOLLIN | EPOLLONESHOT;
+  ev.data.u64 = EV_TOKEN;
+  if (epoll_ctl(epfd, added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, js.rfd,
+                &ev) == 0) {
+    added = 1;
+  }
+}
+
+/*
+ * js_acquire - Take a jobserver token for a background job, waiting
+ *    with the signal mask waitmask until one is free. Returns the
+ *    token, TOKEN_NONE if there is no jobserver (or it broke), or
+ *    TOKEN_INTR if ctrl-c was typed while waiting. The caller has
+ *    SIGCHLD blocked, so the reap path can only return tokens, by way
+ *    of waitmask, while this waits.
+ */
+int js_acquire(const sigset_t* waitmask) {
+  shell_interrupted = 0;
+  while (1) {
+    int token = js_try();
+    if (token != TOKEN_BUSY) {
+      return token;
+    }
+    if (shell_interrupted) {
+      return TOKEN_INTR;
+    }
+    struct pollfd fds[2] = { { js.rfd, POLLIN, 0 }, { sigfd, POLLIN, 0 } };
+    if (ppoll(fds, event_mode ? 2 : 1, NULL, waitmask) > 0
+        && event_mode && fds[1].revents) {
+      event_wait(0, 0); /* reaps, and ctrl-c, arrive on the signalfd */
+    }
+    if (js.implicit) { /* our last & job just finished */
+      js.implicit = 0;
+      return TOKEN_IMPLICIT;
+    }
+  }
+}
+
+/* js_release - Give back a token from js_acquire. Async-signal-safe. */
+void js_release(int token) {
+  if (token == TOKEN_IMPLICIT) {
+    js.implicit = 1;
+  } else if (token >= 0 && js.wfd >= 0) {
+    unsigned char c = token;
+    while (write(js.wfd, &c, 1) < 0 && errno == EINTR) {
+      ;
+    }
+  }
+}
+
+/*
+ * js_create - Become a jobserver with n tokens in all (n-1 in a pipe,
+ *    one implicit), and point MAKEFLAGS at it for children. Returns
+ *    false if the shell already has a jobserver.
+ */
+int js_create(int n) {
+  int pfd[2];
+  char flags[64];
+  if (js.rfd >= 0 || pipe(pfd) < 0) { /* inherited by children, as make's */
+    return 0;
+  }
+  js_open(pfd[0], pfd[1]);
+  if (js.rfd < 0) {
+    close(pfd[0]);
+    close(pfd[1]);
+    return 0;
+  }
+  for (int i = 1; i < n; i++) {
+    if (write(pfd[1], "+", 1) < 0) {
+      break;
+    }
+  }
+  js.own = 1;
+  js.size = n;
+  snprintf(flags, sizeof(flags), " -j%d --jobserver-auth=%d,%d",
+           n, pfd[0], pfd[1]);
+  env_set("MAKEFLAGS", flags);
+  return 1;
+}
+
+/**************
+ * Job watchdog
+ **************/
+
+/*
+ * timeout secs cmd runs cmd as usual, as a job with a deadline. When
+ * the deadline passes, the watchdog sends SIGTERM to the job's process
+ * group, with a SIGCONT in case it is stopped, and TIMEOUT_GRACE secs
+ * later SIGKILL if it is still there; the death is reported by the reap
+ * path like any other. All deadlines share one interval timer: they are
+ * kept in a min-heap of (time, jid), and the timer is set for the top.
+ * A job that finishes early leaves its entry behind, to be discarded
+ * when it pops, since an entry is only acted on if its job still has
+ * that deadline. The heap only grows in the main program; a queued
+ * job, armed from the reap path when it starts, has its slot reserved
+ * when it is queued.
+ */
+
+/* parse_timeout - A timeout's duration in ns, or 0 if invalid. */
+long long parse_timeout(const char* s) {
+  double secs = parse_interval(s);
+  return secs > 0 && secs < 1e9 ? (long long) (secs * 1e9) : 0;
+}
+
+/* watchdog_reserve - Make room in the heap for extra more deadlines
+ *    besides those of queued jobs. Returns false if out of memory.
+ */
+int watchdog_reserve(int extra) {
+  sigset_t prev;
+  block_jobsigs(&prev);
+  int need = wd.n + wd.pending + extra;
+  if (need > wd.cap) {
+    int cap = wd.cap ? wd.cap : 16;
+    while (cap < need) {
+      cap *= 2;
+    }
+    deadline_t* heap = realloc(wd.heap, cap * sizeof(deadline_t));
+    if (heap) {
+      wd.heap = heap;
+      wd.cap = cap;
+    }
+  }
+  sigprocmask(SIG_SETMASK, &prev, NULL);
+  return need <= wd.cap;
+}
+
+/* watchdog_push - Add a deadline, there being room. */
+static void watchdog_push(long long at, int jid) {
+  int i = wd.n++;
+  while (i > 0 && wd.heap[(i - 1) / 2].at > at) {
+    wd.heap[i] = wd.heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  wd.heap[i].at = at;
+  wd.heap[i].jid = jid;
+}
+
+/* watchdog_pop - Remove the earliest deadline. */
+static void watchdog_pop(void) {
+  deadline_t last = wd.heap[--wd.n];
+  int i = 0;
+  for (;;) {
+    int c = 2 * i + 1;
+    if (c >= wd.n) {
+      break;
+    }
+    if (c + 1 < wd.n && wd.heap[c + 1].at < wd.heap[c].at) {
+      c++;
+    }
+    if (wd.heap[c].at >= last.at) {
+      break;
+    }
+    wd.heap[i] = wd.heap[c];
+    i = c;
+  }
+  wd.heap[i] = last;
+}
+
+/* watchdog_settimer - Set the timer for the earliest deadline, or
+ *    disarm it if there is none.
+ */
+static void watchdog_settimer(void) {
+  struct itimerval it = { { 0, 0 }, { 0, 0 } };
+  if (wd.n > 0) {
+    long long us = (wd.heap[0].at - now_ns() + 999) / 1000;
+    if (us < 1) {
+      us = 1;
+    }
+    it.it_value.tv_sec = us / 1000000;
+    it.it_value.tv_usec = us % 1000000;
+  }
+  setitimer(ITIMER_REAL, &it, NULL);
+}
+
+/*
+ * watchdog_arm - Start the deadline of a job just started, limit ns
+ *    from now (none if limit is 0). A slot must have been reserved.
+ *    Async-signal-safe.
+ */
+void watchdog_arm(job_t* job, long long limit) {
+  if (!limit) {
+    return;
+  }
+  sigset_t mask, prev;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGALRM);
+  sigprocmask(SIG_BLOCK, &mask, &prev);
+  job->killed = 0;
+  job->deadline = now_ns() + limit;
+  watchdog_push(job->deadline, job->jid);
+  if (wd.heap[0].jid == job->jid && wd.heap[0].at == job->deadline) {
+    watchdog_settimer();
+  }
+  sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*
+ * sigalrm_handler - The timer went off: signal every job whose
+ *    deadline has passed, and set the timer for the next one.
+ */
+void sigalrm_handler(int sig) {
+  int saved_errno = errno;
+  sigset_t prev;
+  block_jobsigs(&prev); /* the reap path may arm and remove jobs */
+
+  long long now = now_ns();
+  while (wd.n > 0 && wd.heap[0].at <= now) {
+    deadline_t d = wd.heap[0];
+    watchdog_pop();
+    job_t* job = d.jid <= jobs.maxjid ? &jobs.slots[d.jid - 1] : NULL;
+    if (!job || job->state == UNDEF || job->state == QU || job->state == WA
+        || job->deadline != d.at) {
+      continue; /* finished, or the jid is another job's now */
+    }
+    if (!job->killed) {
+      kill(-job->pgid, SIGTERM);
+      kill(-job->pgid, SIGCONT);
+      job->killed = 1;
+      job->deadline = d.at + TIMEOUT_GRACE * 1000000000LL;
+      watchdog_push(job->deadline, job->jid); /* the slot just freed */
+    } else {
+      kill(-job->pgid, SIGKILL);
+      job->deadline = 0;
+    }
+  }
+  watchdog_settimer();
+
+  sigprocmask(SIG_SETMASK, &prev, NULL);
+  errno = saved_errno;
+}
+
+/*******************
+ * Parallel batches
+ *******************/
+
+/*
+ * parallel runs one command over many argument lines with at most N
+ * processes at a time. The whole batch is a single job: its processes
+ * share one process group, so ctrl-c and ctrl-z reach all of them, and
+ * each is in the pid index under the batch's jid. The next item is
+ * started as soon as a process finishes: by the reap path with -e, and
+ * in signal mode by run_deferred, in the main line, once the SIGCHLD
+ * handler has marked the batch for a refill. Reporting and freeing are
+ * left to batch_poll, which runs in the main loop.
+ */
+
+/* batch_additem - Append an item for the argument line text. The
+ *    item's argv is the command with "{}" replaced by the whole line,
+ *    or, if there is no "{}", with the line's words appended.
+ */
+static void batch_additem(batch_t* b, int* cap, const char* text) {
+  if (b->nitems == *cap) {
+    *cap = *cap ? *cap * 2 : 64;
+    b->items = realloc(b->items, *cap * sizeof(pitem_t));
+    if (!b->items) {
+      error("parallel: out of memory");
+    }
+  }
+
+  int nargs = 0, placeholder = 0;
+  for (; b->args[nargs]; nargs++) {
+    placeholder |= !strcmp(b->args[nargs], "{}");
+  }
+  size_t len = strlen(text);
+  int nwords = placeholder ? 0 : (int) len / 2 + 1;
+
+  /* one block: the argv pointers, then a copy of the text to split */
+  char** argv = malloc((nargs + nwords + 1) * sizeof(char*) + len + 1);
+  if (!argv) {
+    error("parallel: out of memory");
+  }
+  char* words = (char*) (argv + nargs + nwords + 1);
+  memcpy(words, text, len + 1);
+  int argc = 0;
+  for (int i = 0; i < nargs; i++) {
+    argv[argc++] = (placeholder && !strcmp(b->args[i], "{}"))
+        ? words : b->args[i];
+  }
+  if (!placeholder) {
+    char* p = words;
+    while (*p) {
+      while (*p == ' ' || *p == '\t') {
+        *p++ = '\0';
+      }
+      if (*p) {
+        argv[argc++] = p;
+      }
+      while (*p && *p != ' ' && *p != '\t') {
+        p++;
+      }
+    }
+  }
+  argv[argc] = NULL;
+
+  pitem_t* it = &b->items[b->nitems++];
+  it->line = strdup(text);
+  it->argv = argv;
+  it->pid = 0;
+  it->state = PI_WAITING;
+  it->status = 0;
+  it->outfd = -1;
+  it->token = TOKEN_NONE;
+}
+
+/* batch_readitems - Add an item for each non-empty line of f. */
+static void batch_readitems(batch_t* b, int* cap, FILE* f) {
+  char* line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  while ((len = getline(&line, &size, f)) >= 0) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+      line[--len] = '\0';
+    }
+    if (len > 0) {
+      batch_additem(b, cap, line);
+    }
+  }
+  free(line);
+}
+
+/* batch_free - Release a batch and everything it owns. */
+static void batch_free(batch_t* b) {
+  for (int i = 0; i < b->nitems; i++) {
+    free(b->items[i].line);
+    free(b->items[i].argv);
+    if (b->items[i].outfd >= 0) {
+      close(b->items[i].outfd);
+    }
+  }
+  for (int i = 0; b->args && b->args[i]; i++) {
+    free(b->args[i]);
+  }
+  free(b->args);
+  free(b->items);
+  free(b->path);
+  free(b);
+}
+
+/* batch_more - Could the job's batch start another item, given room? */
+static int batch_more(job_t* job) {
+  batch_t* b = job->batch;
+  return !b->cancelled && job->state != ST && b->next < b->nitems;
+}
+
+/*
+ * batch_refill - Start items until the batch has maxrun processes
+ *    running, unless it is stopped or was interrupted. Like any
+ *    foreground command, the batch runs one process on the shell's own
+ *    slot; each more takes a jobserver token, and without one the
+ *    batch runs fewer until one of its items gives a token back.
+ *    Called from the main line with SIGCHLD blocked.
+ */
+void batch_refill(job_t* job) {
+  batch_t* b = job->batch;
+  while (batch_more(job) && job->nprocs < b->maxrun) {
+    int token = job->nprocs > 0 ? js_try() : TOKEN_NONE;
+    if (token == TOKEN_BUSY) {
+      break;
+    }
+    int k = b->next++;
+    pitem_t* it = &b->items[k];
+    if (b->keep_order) {
+      it->outfd = memfd_create("parallel", MFD_CLOEXEC);
+    }
+    /* join the group while any member is unreaped, else lead a new one */
+    pid_t pid = launch(b->path, it->argv, NULL, 0,
+                       job->nprocs > 0 ? job->pgid : 0, -1, it->outfd, -1);
+    if (pid == 0) {
+      js_release(token);
+      it->state = PI_DONE;
+      it->status = W_EXITCODE(127, 0);
+      continue;
+    }
+    if (job->nprocs == 0) {
+      job->pgid = pid;
+    }
+    it->token = token;
+    it->pid = pid;
+    it->state = PI_RUNNING;
+    attachpid(&jobs, job, pid, k);
+  }
+  if (job->nprocs == 0) {
+    b->finished = 1;
+  }
+}
+
+/* batch_reaped - Record that the batch's item proc finished with the
+ *    given wait status, and start the next items, or in the SIGCHLD
+ *    handler have the main line start them. Runs in the reap path.
+ */
+void batch_reaped(job_t* job, int proc, int status) {
+  pitem_t* it = &job->batch->items[proc];
+  it->status = status;
+  it->state = PI_DONE;
+  js_release(it->token);
+  it->token = TOKEN_NONE;
+  if (!in_handler) {
+    batch_refill(job);
+  } else if (batch_more(job)) {
+    job->batch->refill = 1;
+    defer_launch();
+  } else if (job->nprocs == 0) {
+    job->batch->finished = 1;
+  }
+}
+
+/* resume_batch - Refill a batch that was just continued by bg or fg. */
+void resume_batch(job_t* job) {
+  sigset_t mask, prev;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, &prev);
+  batch_refill(job);
+  sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/* batch_emit - With -k, write out the captured output of the finished
+ *    items that are next in input order.
+ */
+static void batch_emit(batch_t* b) {
+  while (b->emitted < b->nitems) {
+    pitem_t* it = &b->items[b->emitted];
+    if (it->state != PI_DONE && !(it->state == PI_WAITING && b->finished)) {
+      return;
+    }
+    if (it->outfd >= 0) {
+      out_flush();
+      lseek(it->outfd, 0, SEEK_SET);
+      relay(it->outfd, STDOUT_FILENO);
+      close(it->outfd);
+      it->outfd = -1;
+    }
+    b->emitted++;
+  }
+}
+
+/* batch_report - Summarize the items of a finished batch that failed. */
+static void batch_report(batch_t* b) {
+  int failed = 0, unstarted = 0;
+  for (int i = 0; i < b->nitems; i++) {
+    pitem_t* it = &b->items[i];
+    if (it->state == PI_WAITING) {
+      unstarted++;
+    } else if (it->status != 0) {
+      failed++;
+      if (WIFEXITED(it->status)) {
+        printf("parallel: %s: exit status %d\n", it->line,
+               WEXITSTATUS(it->status));
+      }
+    }
+  }
+  if (failed || unstarted) {
+    printf("parallel: %d of %d items failed", failed, b->nitems);
+    if (unstarted) {
+      printf(", %d not started", unstarted);
+    }
+    printf("\n");
+  }
+}
+
+/*
+ * batch_poll - From the main loop: write out -k output that is ready,
+ *    and report and free the batches that have finished.
+ */
+void batch_poll(void) {
+  sigset_t mask, prev;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, &prev);
+
+  batch_t** link = &batches;
+  while (*link) {
+    batch_t* b = *link;
+    if (b->keep_order) {
+      batch_emit(b);
+    }
+    if (b->finished) {
+      batch_report(b);
+      *link = b->next_batch;
+      batch_free(b);
+    } else {
+      link = &b->next_batch;
+    }
+  }
+
+  sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*
+ * do_parallel - Execute the builtin parallel command.
+ *    parallel [-j N] [-k] [-a file] command [arg...] [::: item...]
+ *
+ *    Runs command once per item, at most N at a time (default: one per
+ *    CPU). Items are the words after :::, or the lines of file; with
+ *    "-a -" they are read from standard input, which, when it also
+ *    carries the shell's commands, ends at a line holding just ".".
+ *    With -k, output is written in item order rather than as produced.
+ */
+void do_parallel(char** argv) {
+  int maxrun = sysconf(_SC_NPROCESSORS_ONLN);
+  int keep_order = 0;
+  char* itemfile = NULL;
+  int i;
+
+  for (i = 1; argv[i] && argv[i][0] == '-'; i++) {
+    if (!strcmp(argv[i], "-k")) {
+      keep_order = 1;
+    } else if (!strcmp(argv[i], "-j") && argv[i + 1]) {
+      maxrun = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-a") && argv[i + 1]) {
+      itemfile = argv[++i];
+    } else {
+      break;
+    }
+  }
+  if (!argv[i] || argv[i][0] == '-' || maxrun < 1) {
+    printf("usage: parallel [-j N] [-k] [-a file] command [arg...] "
+           "[::: item...]\n");
+    return;
+  }
+
+  batch_t* b = calloc(1, sizeof(batch_t));
+  int nargs = 0, cap = 0;
+  while (argv[i + nargs] && strcmp(argv[i + nargs], ":::")) {
+    nargs++;
+  }
+  b->args = calloc(nargs + 1, sizeof(char*));
+  for (int k = 0; k < nargs; k++) {
+    b->args[k] = strdup(argv[i + k]);
+  }
+  b->maxrun = maxrun;
+  b->keep_order = keep_order;
+
+  if (argv[i + nargs]) { /* ::: item... */
+    for (char** item = &argv[i + nargs + 1]; *item; item++) {
+      batch_additem(b, &cap, *item);
+    }
+  } else if (itemfile && !strcmp(itemfile, "-") && input.fd == STDIN_FILENO) {
+    char* line;
+    while ((line = input_readline(&input)) && strcmp(line, ".\n")) {
+      line[strcspn(line, "\r\n")] = '\0';
+      if (*line) {
+        batch_additem(b, &cap, line);
+      }
+    }
+  } else if (itemfile) {
+    FILE* f = strcmp(itemfile, "-") ? fopen(itemfile, "r")
+        : fdopen(dup(STDIN_FILENO), "r");
+    if (!f) {
+      printf("parallel: %s: %s\n", itemfile, strerror(errno));
+      batch_free(b);
+      return;
+    }
+    batch_readitems(b, &cap, f);
+    fclose(f);
+  }
+  if (b->nitems == 0) {
+    batch_free(b);
+    return;
+  }
+
+  char* path = lookup_cmd(b->args[0]);
+  if (!path) {
+    printf("%s: Command not found\n", b->args[0]);
+    batch_free(b);
+    return;
+  }
+  b->path = strdup(path);
+
+  /* the job shows up in jobs as the parallel command line */
+  char cmdline[MAXLINE];
+  size_t len = 0;
+  for (int k = 0; argv[k] && len < MAXLINE - 2; k++) {
+    len += snprintf(cmdline + len, MAXLINE - 1 - len, k ? " %s" : "%s",
+                    argv[k]);
+  }
+  if (len > MAXLINE - 2) {
+    len = MAXLINE - 2;
+  }
+  strcpy(cmdline + len, "\n");
+
+  sigset_t mask, prev;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, &prev);
+
+  /* the job is taken first, so the first item's process, which leads
+     its process group, is never left without one */
+  job_t* job = takejob(&jobs, QU, cmdline);
+  pitem_t* first = &b->items[0];
+  if (job && keep_order) {
+    first->outfd = memfd_create("parallel", MFD_CLOEXEC);
+  }
+  pid_t pid = job ? launch(b->path, first->argv, NULL, 0, 0, -1,
+                           first->outfd, -1) : 0;
+  if (pid == 0) {
+    if (job) {
+      removejob(&jobs, job);
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    batch_free(b);
+    return;
+  }
+  joinjob(&jobs, job, pid, 0, FG);
+  first->pid = pid;
+  first->state = PI_RUNNING;
+  b->next = 1;
+  if (!pidindex_reserve(&jobs, b->maxrun)) {
+    b->maxrun = 1;
+  }
+  job->batch = b;
+  b->jid = job->jid;
+  b->next_batch = batches;
+  batches = b;
+  batch_refill(job);
+
+  /* wait like waitfg, writing out -k output as it becomes ready */
+  while (fgpid(&jobs) == pid) {
+    if (event_mode) {
+      event_wait(0, -1);
+    } else {
+      sigsuspend(&prev);
+      run_deferred();
+    }
+    batch_poll();
+  }
+  sigprocmask(SIG_SETMASK, &prev, NULL);
+  batch_poll();
+}
+
+/********************************
+ * Command path lookup and cache
+ ********************************/
+
+/*
+ * Commands without a '/' are searched for along $PATH in the shell
+ * itself, so a missing command costs no process. Every answer, found
+ * or not, is remembered in cmdtab. The table is dropped whenever PATH
+ * changes, and any cached answer, hit or miss, is only trusted after
+ * the mtimes of the PATH directories are re-checked: one stat per
+ * directory rather than one per candidate file. So a command installed
+ * earlier on the PATH than the one cached, or one removed, is seen at
+ * once, where bash keeps using a stale hit until hash -r.
+ */
+
+/* fnv1a - FNV-1a hash of a NUL-terminated string */
+static unsigned int fnv1a(const char* s) {
+  unsigned int h = 2166136261u;
+  while (*s) {
+    h = (h ^ (unsigned char) *s++) * 16777619u;
+  }
+  return h;
+}
+
+/* cmdtab_clear - Forget every cached lookup and PATH directory. */
+static void cmdtab_clear(void) {
+  for (int i = 0; i < cmdtab.size; i++) {
+    cmdent_t* ent = cmdtab.buckets[i];
+    while (ent) {
+      cmdent_t* next = ent->next;
+      free(ent->name);
+      free(ent->path);
+      free(ent);
+      ent = next;
+    }
+    cmdtab.buckets[i] = NULL;
+  }
+  cmdtab.count = 0;
+  for (int i = 0; i < cmdtab.ndirs; i++) {
+    free(cmdtab.dirs[i].dir);
+  }
+  free(cmdtab.dirs);
+  cmdtab.dirs = NULL;
+  cmdtab.ndirs = 0;
+  free(cmdtab.pathvar);
+  cmdtab.pathvar = NULL;
+}
+
+/* split_path - Split a PATH value into directories, noting each
+ *    one's current mtime, and set *n to their number. An empty entry
+ *    means ".".
+ */
+static pathdir_t* split_path(const char* pathvar, int* n) {
+  *n = 1;
+  for (const char* p = pathvar; *p; p++) {
+    *n += (*p == ':');
+  }
+  pathdir_t* dirs = calloc(*n, sizeof(pathdir_t));
+  const char* p = pathvar;
+  for (int i = 0; i < *n; i++) {
+    const char* end = strchr(p, ':');
+    size_t len = end ? (size_t) (end - p) : strlen(p);
+    dirs[i].dir = (len == 0) ? strdup(".") : strndup(p, len);
+    struct stat sb;
+    if (stat(dirs[i].dir, &sb) == 0) {
+      dirs[i].mtime = sb.st_mtim;
+    }
+    p = end ? end + 1 : p + len;
+  }
+  return dirs;
+}
+
+/* cmdtab_setpath - Split a PATH value into the directory list. */
+static void cmdtab_setpath(const char* pathvar) {
+  cmdtab.pathvar = strdup(pathvar);
+  cmdtab.dirs = split_path(pathvar, &cmdtab.ndirs);
+}
+
+/* cmdtab_dirs_changed - Return true (and note the new mtimes) if any
+ *    PATH directory has gained or lost entries since it was last seen.
+ */
+static int cmdtab_dirs_changed(void) {
+  int changed = 0;
+  for (int i = 0; i < cmdtab.ndirs; i++) {
+    struct stat sb;
+    struct timespec mtime = {0, 0};
+    if (stat(cmdtab.dirs[i].dir, &sb) == 0) {
+      mtime = sb.st_mtim;
+    }
+    if (mtime.tv_sec != cmdtab.dirs[i].mtime.tv_sec
+        || mtime.tv_nsec != cmdtab.dirs[i].mtime.tv_nsec) {
+      cmdtab.dirs[i].mtime = mtime;
+      changed = 1;
+    }
+  }
+  return changed;
+}
+
+/* cmdtab_search - Search the PATH directories for an executable named
+ *    name. Returns a malloc'd path, or NULL if there is none.
+ */
+static char* cmdtab_search(const char* name) {
+  size_t namelen = strlen(name);
+  for (int i = 0; i < cmdtab.ndirs; i++) {
+    size_t dirlen = strlen(cmdtab.dirs[i].dir);
+    char* cand = malloc(dirlen + namelen + 2);
+    memcpy(cand, cmdtab.dirs[i].dir, dirlen);
+    cand[dirlen] = '/';
+    memcpy(cand + dirlen + 1, name, namelen + 1);
+    struct stat sb;
+    if (stat(cand, &sb) == 0 && S_ISREG(sb.st_mode)
+        && access(cand, X_OK) == 0) {
+      return cand;
+    }
+    free(cand);
+  }
+  return NULL;
+}
+
+/* cmdtab_find - Return the entry for name, or NULL if not cached. */
+static cmdent_t* cmdtab_find(const char* name, unsigned int hash) {
+  cmdent_t* ent = cmdtab.buckets[hash & (cmdtab.size - 1)];
+  while (ent && (ent->hash != hash || strcmp(ent->name, name))) {
+    ent = ent->next;
+  }
+  return ent;
+}
+
+/* cmdtab_insert - Cache the lookup result path (NULL for a miss). */
+static cmdent_t* cmdtab_insert(const char* name, unsigned int hash,
+                               char* path) {
+  if (cmdtab.count >= cmdtab.size) { /* keep chains short: double */
+    int newsize = cmdtab.size * 2;
+    cmdent_t** buckets = calloc(newsize, sizeof(cmdent_t*));
+    for (int i = 0; i < cmdtab.size; i++) {
+      cmdent_t* ent = cmdtab.buckets[i];
+      while (ent) {
+        cmdent_t* next = ent->next;
+        ent->next = buckets[ent->hash & (newsize - 1)];
+        buckets[ent->hash & (newsize - 1)] = ent;
+        ent = next;
+      }
+    }
+    free(cmdtab.buckets);
+    cmdtab.buckets = buckets;
+    cmdtab.size = newsize;
+  }
+  cmdent_t* ent = malloc(sizeof(cmdent_t));
+  ent->name = strdup(name);
+  ent->path = path;
+  ent->hash = hash;
+  ent->hits = 0;
+  ent->next = cmdtab.buckets[hash & (cmdtab.size - 1)];
+  cmdtab.buckets[hash & (cmdtab.size - 1)] = ent;
+  cmdtab.count++;
+  return ent;
+}
+
+/* initcmdtab - Initialize the command hash table. */
+void initcmdtab(void) {
+  cmdtab.size = CMDTAB_INIT;
+  cmdtab.buckets = calloc(cmdtab.size, sizeof(cmdent_t*));
+  if (!cmdtab.buckets) {
+    error("initcmdtab: out of memory");
+  }
+}
+
+/*
+ * lookup_cmd - Resolve a command name to the file to execute. Names
+ *    containing a '/' are used as given. Returns NULL if the command
+ *    is not on the PATH.
+ */
+char* lookup_cmd(char* name) {
+  if (strchr(name, '/')) {
+    return name;
+  }
+
+  const char* pathvar = env_get("PATH");
+  if (!pathvar) {
+    pathvar = DEFAULT_PATH;
+  }
+  if (!cmdtab.pathvar || strcmp(pathvar, cmdtab.pathvar)) {
+    cmdtab_clear();
+    cmdtab_setpath(pathvar);
+  }
+
+  unsigned int hash = fnv1a(name);
+  cmdent_t* ent = cmdtab_find(name, hash);
+  if (ent && cmdtab_dirs_changed()) {
+    /* something was installed or removed: start over */
+    char* saved = strdup(cmdtab.pathvar);
+    cmdtab_clear();
+    cmdtab_setpath(saved);
+    free(saved);
+    ent = NULL;
+  }
+  if (!ent) {
+    ent = cmdtab_insert(name, hash, cmdtab_search(name));
+  }
+  ent->hits++;
+  return ent->path;
+}
+
+/* forget_cmd - Drop the cached lookup for name, e.g. after the cached
+ *    file turned out not to be executable any more.
+ */
+void forget_cmd(const char* name) {
+  unsigned int hash = fnv1a(name);
+  cmdent_t** link = &cmdtab.buckets[hash & (cmdtab.size - 1)];
+  while (*link) {
+    cmdent_t* ent = *link;
+    if (ent->hash == hash && !strcmp(ent->name, name)) {
+      *link = ent->next;
+      free(ent->name);
+      free(ent->path);
+      free(ent);
+      cmdtab.count--;
+      return;
+    }
+    link = &ent->next;
+  }
+}
+
+/* cmdtab_chdir - The working directory changed: lookups made through
+ *    relative PATH directories no longer hold.
+ */
+void cmdtab_chdir(void) {
+  for (int i = 0; i < cmdtab.ndirs; i++) {
+    if (cmdtab.dirs[i].dir[0] != '/') {
+      cmdtab_clear();
+      return;
+    }
+  }
+}
+
+/*
+ * do_hash - Execute the builtin hash command.
+ *    hash          list the cached lookups and their hit counts
+ *    hash -r       forget all cached lookups
+ *    hash name...  look up (and cache) the named commands
+ */
+void do_hash(char** argv) {
+  if (argv[1] && !strcmp(argv[1], "-r")) {
+    cmdtab_clear();
+    return;
+  }
+  if (argv[1]) {
+    for (int i = 1; argv[i]; i++) {
+      if (!lookup_cmd(argv[i])) {
+        printf("hash: %s: not found\n", argv[i]);
+      }
+    }
+    return;
+  }
+  if (cmdtab.count == 0) {
+    printf("hash: hash table empty\n");
+    return;
+  }
+  printf("hits\tcommand\n");
+  for (int i = 0; i < cmdtab.size; i++) {
+    for (cmdent_t* ent = cmdtab.buckets[i]; ent; ent = ent->next) {
+      if (ent->path) {
+        printf("%4d\t%s\n", ent->hits, ent->path);
+      } else {
+        printf("%4d\t%s (not found)\n", ent->hits, ent->name);
+      }
+    }
+  }
+}
+
+/*************
+ * Environment
+ *************/
+
+/*
+ * The shell keeps the environment itself, in envtab: the variables
+ * are hashed by name, and the envp array children get is kept beside
+ * them, so a launch passes it as it is instead of building one. A
+ * change to a variable is a change to one envp slot: a new value
+ * takes over its slot, a new variable goes at the end, and an unset
+ * one is replaced by the last. Changes are made with the job signals
+ * blocked, as a handler may be launching a queued job.
+ *
+ * The VAR=value words before a command are laid over envp for its
+ * launch only (env_overlay): each takes the place of its variable's
+ * pointer, or goes past the end, and env_restore puts envp back. That
+ * costs a hash lookup per word, whatever the size of the environment.
+ * The process environment (environ) is only read at startup.
+ */
+
+/* env_hash - FNV-1a hash of the len bytes of a name */
+static unsigned int env_hash(const char* name, size_t len) {
+  unsigned int h = 2166136261u;
+  while (len-- > 0) {
+    h = (h ^ (unsigned char) *name++) * 16777619u;
+  }
+  return h;
+}
+
+/* env_namelen - Length of the name in a NAME=value word, or 0 if it
+ *    is not one.
+ */
+static size_t env_namelen(const char* word) {
+  size_t len = 0;
+  if (!isalpha((unsigned char) word[0]) && word[0] != '_') {
+    return 0;
+  }
+  while (isalnum((unsigned char) word[len]) || word[len] == '_') {
+    len++;
+  }
+  return word[len] == '=' ? len : 0;
+}
+
+/* env_isname - Is s a variable name? */
+static int env_isname(const char* s) {
+  size_t len = 0;
+  while (isalnum((unsigned char) s[len]) || s[len] == '_') {
+    len++;
+  }
+  return len > 0 && !s[len] && !isdigit((unsigned char) s[0]);
+}
+
+/* env_find - The variable whose name is the len bytes at name, or
+ *    NULL if there is none.
+ */
+static envvar_t* env_find(const char* name, size_t len, unsigned int hash) {
+  envvar_t* v = envtab.buckets[hash & (envtab.size - 1)];
+  while (v && (v->hash != hash || v->namelen != len
+               || memcmp(v->entry, name, len))) {
+    v = v->next;
+  }
+  return v;
+}
+
+/* env_grow - Make room in envp for n more variables and the spare
+ *    slots. Returns false if out of memory.
+ */
+static int env_grow(int n) {
+  int need = envtab.count + n + envtab.spare + 1;
+  if (need <= envtab.cap) {
+    return 1;
+  }
+  int cap = envtab.cap ? envtab.cap : 64;
+  while (cap < need) {
+    cap *= 2;
+  }
+  char** envp = realloc(envtab.envp, cap * sizeof(char*));
+  if (!envp) {
+    return 0;
+  }
+  envtab.envp = envp;
+  envtab.cap = cap;
+  return 1;
+}
+
+/* env_put - Set a variable from a malloc'd NAME=value entry, which the
+ *    table takes. Returns false if out of memory.
+ */
+static int env_put(char* entry, size_t namelen) {
+  unsigned int hash = env_hash(entry, namelen);
+  envvar_t* v = env_find(entry, namelen, hash);
+  if (v) {
+    free(v->entry);
+    v->entry = envtab.envp[v->slot] = entry;
+    return 1;
+  }
+  if (envtab.count >= envtab.size) { /* keep chains short: double */
+    int newsize = envtab.size * 2;
+    envvar_t** buckets = calloc(newsize, sizeof(envvar_t*));
+    if (!buckets) {
+      return 0;
+    }
+    for (int i = 0; i < envtab.size; i++) {
+      envvar_t* u = envtab.buckets[i];
+      while (u) {
+        envvar_t* next = u->next;
+        u->next = buckets[u->hash & (newsize - 1)];
+        buckets[u->hash & (newsize - 1)] = u;
+        u = next;
+      }
+    }
+    free(envtab.buckets);
+    envtab.buckets = buckets;
+    envtab.size = newsize;
+  }
+  if (!env_grow(1) || !(v = malloc(sizeof(envvar_t)))) {
+    return 0;
+  }
+  v->entry = entry;
+  v->namelen = namelen;
+  v->hash = hash;
+  v->slot = envtab.count;
+  v->next = envtab.buckets[hash & (envtab.size - 1)];
+  envtab.buckets[hash & (envtab.size - 1)] = v;
+  envtab.envp[envtab.count++] = entry;
+  envtab.envp[envtab.count] = NULL;
+  return 1;
+}
+
+/* initenv - Load the environment the shell was started with. */
+void initenv(void) {
+  envtab.size = ENVTAB_INIT;
+  envtab.buckets = calloc(envtab.size, sizeof(envvar_t*));
+  if (!envtab.buckets || !env_grow(0)) {
+    error("initenv: out of memory");
+  }
+  envtab.envp[0] = NULL;
+  for (char** e = environ; *e; e++) {
+    size_t namelen = env_namelen(*e);
+    char* entry = namelen ? strdup(*e) : NULL;
+    if (entry && !env_put(entry, namelen)) {
+      error("initenv: out of memory");
+    }
+  }
+}
+
+/* env_get - The value of variable name, or NULL if it is not set. */
+char* env_get(const char* name) {
+  size_t len = strlen(name);
+  envvar_t* v = env_find(name, len, env_hash(name, len));
+  return v ? v->entry + len + 1 : NULL;
+}
+
+/* env_set - Set variable name to value. Returns false (and says so) if
+ *    out of memory.
+ */
+int env_set(const char* name, const char* value) {
+  size_t namelen = strlen(name);
+  char* entry = malloc(namelen + strlen(value) + 2);
+  sigset_t prev;
+  int ok = 0;
+
+  if (entry) {
+    sprintf(entry, "%s=%s", name, value);
+    block_jobsigs(&prev);
+    ok = env_put(entry, namelen);
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+  }
+  if (!ok) {
+    free(entry);
+    printf("%s: out of memory\n", name);
+  }
+  return ok;
+}
+
+/* env_unset - Remove variable name, if set. */
+static void env_unset(const char* name) {
+  size_t len = strlen(name);
+  unsigned int hash = env_hash(name, len);
+  envvar_t** link = &envtab.buckets[hash & (envtab.size - 1)];
+  while (*link && ((*link)->hash != hash || (*link)->namelen != len
+                   || memcmp((*link)->entry, name, len))) {
+    link = &(*link)->next;
+  }
+  envvar_t* v = *link;
+  if (!v) {
+    return;
+  }
+  sigset_t prev;
+  block_jobsigs(&prev);
+  *link = v->next;
+  char* last = envtab.envp[--envtab.count]; /* the last takes its slot */
+  if (v->slot < envtab.count) {
+    size_t lastlen = strchr(last, '=') - last;
+    env_find(last, lastlen, env_hash(last, lastlen))->slot = v->slot;
+    envtab.envp[v->slot] = last;
+  }
+  envtab.envp[envtab.count] = NULL;
+  sigprocmask(SIG_SETMASK, &prev, NULL);
+  free(v->entry);
+  free(v);
+}
+
+/* env_assigns - Number of VAR=value words argv starts with. */
+int env_assigns(char** argv) {
+  int n = 0;
+  while (argv[n] && env_namelen(argv[n])) {
+    n++;
+  }
+  return n;
+}
+
+/* env_reserve - Keep room in envp for n overrides from now on, for
+ *    a launch (from a signal handler) that can't allocate. Returns
+ *    false if out of memory.
+ */
+int env_reserve(int n) {
+  if (n > envtab.spare) {
+    sigset_t prev;
+    block_jobsigs(&prev);
+    int spare = envtab.spare;
+    envtab.spare = n;
+    if (!env_grow(0)) {
+      envtab.spare = spare;
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+  }
+  return n <= envtab.spare;
+}
+
+/*
+ * env_overlay - The envp for a child with the n VAR=value words env on
+ *    top of the environment, noting in saved what each one displaced
+ *    for env_restore. A later word wins over an earlier one for the
+ *    same variable. Returns NULL if out of memory.
+ */
+char** env_overlay(char** env, int n, char** saved) {
+  if (n > envtab.spare && !env_reserve(n)) {
+    return NULL;
+  }
+  int end = envtab.count;
+  for (int i = 0; i < n; i++) {
+    size_t len = env_namelen(env[i]);
+    envvar_t* v = env_find(env[i], len, env_hash(env[i], len));
+    int slot = v ? v->slot : envtab.count;
+    while (!v && slot < end && strncmp(envtab.envp[slot], env[i], len + 1)) {
+      slot++; /* one of ours, set by an earlier word? */
+    }
+    saved[i] = v ? envtab.envp[slot] : NULL;
+    envtab.envp[slot] = env[i];
+    end += slot == end;
+  }
+  envtab.envp[end] = NULL;
+  return envtab.envp;
+}
+
+/* env_restore - Undo env_overlay. */
+void env_restore(char** env, int n, char** saved) {
+  for (int i = n - 1; i >= 0; i--) {
+    if (saved[i]) {
+      size_t len = env_namelen(env[i]);
+      envtab.envp[env_find(env[i], len, env_hash(env[i], len))->slot] =
+          saved[i];
+    }
+  }
+  envtab.envp[envtab.count] = NULL;
+}
+
+/*
+ * do_export - Execute the builtin export command.
+ *    export              list the environment
+ *    export VAR=value... set the variables
+ *    export VAR...       (nothing: every variable is exported)
+ */
+int do_export(char** argv) {
+  int status = 0;
+  if (!argv[1]) {
+    for (int i = 0; i < envtab.count; i++) {
+      printf("%s\n", envtab.envp[i]);
+    }
+    return 0;
+  }
+  for (int i = 1; argv[i]; i++) {
+    size_t len = env_namelen(argv[i]);
+    if (len) {
+      argv[i][len] = '\0';
+      status |= !env_set(argv[i], argv[i] + len + 1);
+      argv[i][len] = '=';
+    } else if (!env_isname(argv[i])) {
+      printf("export: '%s': not a valid identifier\n", argv[i]);
+      status = 1;
+    }
+  }
+  return status;
+}
+
+/* do_unset - Execute the builtin unset command. */
+int do_unset(char** argv) {
+  int status = 0;
+  for (int i = 1; argv[i]; i++) {
+    if (env_isname(argv[i])) {
+      env_unset(argv[i]);
+    } else {
+      printf("unset: '%s': not a valid identifier\n", argv[i]);
+      status = 1;
+    }
+  }
+  return status;
+}
+
+/*******************************
+ * Command input
+ *******************************/
+
+/*
+ * The shell reads its commands through a small buffered reader on a
+ * raw file descriptor rather than through stdio, so the event loop can
+ * tell whether a complete line is already buffered before it waits
+ * for stdin to become readable.
+ */
+
+/* initinput - Start reading commands from fd. */
+void initinput(input_t* in, int fd) {
+  in->fd = fd;
+  in->cap = INPUT_BUFSIZE;
+  in->buf = malloc(in->cap);
+  if (!in->buf) {
+    error("initinput: out of memory");
+  }
+  in->start = in->end = 0;
+  in->maxline = (size_t)-1; /* no limit: the buffer grows to fit */
+  in->held = -1;
+  in->eof = 0;
+  in->mapped = 0;
+}
+
+/*
+ * input_map - If the input is a regular file, replace the read buffer
+ *    with a private, writable mapping of the rest of the file, so the
+ *    whole script is "read" at once and lines are cut in place. Two
+ *    bytes of anonymous slack follow the file for input_readline's
+ *    final '\n' and NUL. Returns true if the input is now mapped.
+ */
+int input_map(input_t* in) {
+  struct stat sb;
+  if (fstat(in->fd, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+    return 0;
+  }
+  off_t pos = lseek(in->fd, 0, SEEK_CUR);
+  if (pos < 0 || pos > sb.st_size) {
+    return 0;
+  }
+  size_t len = sb.st_size;
+  size_t span = len + 2;
+  char* base = mmap(NULL, span, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    return 0;
+  }
+  if (len > 0) {
+    if (mmap(base, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+             in->fd, 0) == MAP_FAILED) {
+      munmap(base, span);
+      return 0;
+    }
+    madvise(base, len, MADV_SEQUENTIAL);
+  }
+  free(in->buf);
+  in->buf = base;
+  in->cap = span;
+  in->start = pos;
+  in->end = len;
+  in->eof = 1;
+  in->mapped = 1;
+  return 1;
+}
+
+/* input_makeroom - Make sure there is space past the buffered bytes
+ *    for more input plus a terminating NUL.
+ */
+static void input_makeroom(input_t* in) {
+  if (in->mapped) { /* input_map left slack for the '\n' and NUL */
+    return;
+  }
+  if (in->start > 0) {
+    memmove(in->buf, in->buf + in->start, in->end - in->start);
+    in->end -= in->start;
+    in->start = 0;
+  }
+  if (in->end + 2 >= in->cap) {
+    char* buf = realloc(in->buf, in->cap * 2);
+    if (!buf) {
+      error("input_fill: out of memory");
+    }
+    in->buf = buf;
+    in->cap *= 2;
+  }
+}
+
+/* input_wait - Without -e, wait until fd has input, starting what the
+ *    SIGCHLD handler leaves for the main line in the meantime, and
+ *    queued jobs as jobserver tokens come free.
+ */
+void input_wait(int fd) {
+  struct pollfd fds[3] = { { fd, POLLIN, 0 }, { wake_pipe[0], POLLIN, 0 },
+                           { js.rfd, POLLIN, 0 } };
+  while (1) {
+    run_deferred();
+    if (poll(fds, runq.starved ? 3 : 2, -1) > 0 && fds[0].revents) {
+      return;
+    }
+    if (runq.starved && fds[2].revents) { /* a token for the queue */
+      launch_pending = 1;
+    }
+  }
+}
+
+/* input_fill - Read more bytes into the buffer. Sets in->eof at end
+ *    of file. One byte is always left free for the NUL.
+ */
+static void input_fill(input_t* in) {
+  input_makeroom(in);
+  if (event_mode) {
+    while (!event_wait(1, -1)) {
+      ;
+    }
+  } else {
+    input_wait(in->fd);
+  }
+  ssize_t n;
+  while ((n = read(in->fd, in->buf + in->end, in->cap - in->end - 1)) < 0) {
+    if (errno != EINTR) {
+      error("read error");
+    }
+  }
+  if (n == 0) {
+    in->eof = 1;
+  }
+  in->end += n;
+}
+
+/*
+ * input_readline - Return the next command line, '\n' included and
+ *    NUL-terminated in place, or NULL at end of input. Lines longer
+ *    than in->maxline come back in pieces. A final line
+ *    without a newline gets one. The line stays valid until the next
+ *    call.
+ */
+char* input_readline(input_t* in) {
+  if (in->held >= 0) { /* put back the byte the last NUL covered */
+    in->buf[in->held] = in->heldch;
+    in->held = -1;
+  }
+
+  size_t scanned = 0; /* bytes past start known to hold no newline */
+  size_t len;
+  while (1) {
+    char* nl = memchr(in->buf + in->start + scanned, '\n',
+                      in->end - in->start - scanned);
+    if (nl) {
+      len = nl + 1 - (in->buf + in->start);
+      break;
+    }
+    scanned = in->end - in->start;
+    if (scanned >= in->maxline) {
+      len = in->maxline;
+      break;
+    }
+    if (in->eof) {
+      if (scanned == 0) {
+        return NULL;
+      }
+      input_makeroom(in);
+      in->buf[in->end++] = '\n';
+      len = scanned + 1;
+      break;
+    }
+    input_fill(in);
+  }
+  if (len > in->maxline) {
+    len = in->maxline;
+  }
+
+  char* line = in->buf + in->start;
+  in->start += len;
+  if (in->start < in->end) { /* the NUL covers the next line's first byte */
+    in->held = in->start;
+    in->heldch = in->buf[in->start];
+  }
+  in->buf[in->start] = '\0';
+  return line;
+}
+
+/*****************
+ * Command history
+ *****************/
+
+/*
+ * Each line read in the main loop is appended to the history file,
+ * $BSH_HISTORY or ~/.bsh_history, one line per entry. The file is kept
+ * for interactive shells, and for any shell but a script when
+ * BSH_HISTORY names it (set it empty to keep none). Lines are buffered
+ * and written HISTORY_FLUSH bytes at a time and at exit, with no
+ * fsync, and with O_APPEND so that concurrent shells interleave whole
+ * writes. At startup the file is only mapped, not read, so a large
+ * history costs nothing until it is searched.
+ *
+ * The first history command cuts the mapping into entries; the first
+ * search also builds a trigram index: for every entry, the three-byte
+ * substrings it contains, plus its first one, two and three bytes as
+ * start keys. A substring search then verifies only the entries in the
+ * shortest posting list of the query's trigrams, and a prefix search
+ * those under its start key. Entries added later are indexed as they
+ * come. Queries too short for a trigram, and a history too large to
+ * index, are scanned instead.
+ */
+
+/* inithistory - Open and map the history file, if one is kept. */
+void inithistory(int interactive) {
+  char path[PATH_MAX];
+  const char* name = env_get("BSH_HISTORY");
+  const char* home = env_get("HOME");
+  struct stat sb;
+  if (!name) {
+    if (!interactive || !home) {
+      return;
+    }
+    snprintf(path, sizeof(path), "%s/%s", home, HISTORY_FILE);
+    name = path;
+  }
+  if (!*name
+      || (history.fd = open(name, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+                            0600)) < 0
+      || fstat(history.fd, &sb) < 0 || sb.st_size == 0) {
+    return;
+  }
+  history.map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE,
+                     history.fd, 0);
+  if (history.map == MAP_FAILED) { /* keep adding to it, unsearched */
+    history.map = NULL;
+    return;
+  }
+  history.maplen = sb.st_size;
+  if (history.map[history.maplen - 1] != '\n') { /* a torn last write */
+    if (write(history.fd, "\n", 1) < 0) {
+      history.fd = -1;
+    }
+  }
+}
+
+/* history_entry - Entry i's text, without its '\n'. */
+static const char* history_entry(uint32_t i, size_t* len) {
+  size_t start = history.starts[i];
+  size_t end = i + 1 < history.nentries ? history.starts[i + 1]
+             : history.maplen + history.sesslen;
+  const char* text;
+  if (start < history.maplen) {
+    text = history.map + start;
+    end = end < history.maplen ? end : history.maplen;
+  } else {
+    text = history.sess + (start - history.maplen);
+  }
+  *len = end - start;
+  if (*len > 0 && text[*len - 1] == '\n') {
+    (*len)--;
+  }
+  return text;
+}
+
+/* history_addstart - Record that an entry starts at offset off. */
+static int history_addstart(size_t off) {
+  if (history.nentries == history.startcap) {
+    uint32_t cap = history.startcap * 2;
+    size_t* starts = realloc(history.starts, cap * sizeof(size_t));
+    if (!starts) {
+      return 0;
+    }
+    history.starts = starts;
+    history.startcap = cap;
+  }
+  history.starts[history.nentries++] = off;
+  return 1;
+}
+
+/* history_lines - Build the entry index, if not yet built. Returns
+ *    false if out of memory.
+ */
+static int history_lines(void) {
+  if (history.starts) {
+    return 1;
+  }
+  if (!(history.starts = malloc(1024 * sizeof(size_t)))) {
+    return 0;
+  }
+  history.startcap = 1024;
+  const char* bufs[2] = { history.map, history.sess };
+  size_t lens[2] = { history.maplen, history.sesslen };
+  size_t base = 0;
+  for (int b = 0; b < 2; b++) {
+    for (size_t off = 0; off < lens[b]; ) {
+      const char* nl = memchr(bufs[b] + off, '\n', lens[b] - off);
+      if (!history_addstart(base + off)) {
+        free(history.starts);
+        history.starts = NULL;
+        history.nentries = history.startcap = 0;
+        return 0;
+      }
+      off = nl ? (size_t) (nl - bufs[b]) + 1 : lens[b];
+    }
+    base += lens[b];
+  }
+  return 1;
+}
+
+/* trikey - The index key of n bytes at p: a trigram, or with start
+ *    set, the first n (1..3) bytes of an entry.
+ */
+static uint32_t trikey(const char* p, int n, int start) {
+  uint32_t key = start ? (uint32_t) (4 + n) << 24 : 0;
+  for (int i = 0; i < n; i++) {
+    key |= (uint32_t) (unsigned char) p[i] << (8 * (2 - i));
+  }
+  return key;
+}
+
+/* tri_slot - The bucket of key in the trigram index, or the empty one
+ *    where it would go.
+ */
+static trigram_t* tri_slot(uint32_t key) {
+  uint32_t h = key * 0x9E3779B1u;
+  uint32_t i = (h ^ (h >> 16)) & (history.tricap - 1);
+  while (history.tri[i].key && history.tri[i].key != key) {
+    i = (i + 1) & (history.tricap - 1);
+  }
+  return &history.tri[i];
+}
+
+/* tri_free - Drop the trigram index. */
+static void tri_free(void) {
+  for (uint32_t i = 0; i < history.tricap; i++) {
+    free(history.tri[i].ids);
+  }
+  free(history.tri);
+  history.tri = NULL;
+  history.tricap = history.ntri = 0;
+}
+
+/* tri_post - Note that entry id contains key. */
+static int tri_post(uint32_t key, uint32_t id) {
+  if (2 * (history.ntri + 1) > history.tricap) { /* keep it half empty */
+    trigram_t* old = history.tri;
+    uint32_t oldcap = history.tricap;
+    trigram_t* tri = calloc(oldcap * 2, sizeof(trigram_t));
+    if (!tri) {
+      return 0;
+    }
+    history.tri = tri;
+    history.tricap = oldcap * 2;
+    for (uint32_t i = 0; i < oldcap; i++) {
+      if (old[i].key) {
+        *tri_slot(old[i].key) = old[i];
+      }
+    }
+    free(old);
+  }
+  trigram_t* t = tri_slot(key);
+  if (!t->key) {
+    t->key = key;
+    history.ntri++;
+  }
+  if (t->n > 0 && t->ids[t->n - 1] == id) { /* repeated in the entry */
+    return 1;
+  }
+  if (t->n == t->cap) {
+    uint32_t cap = t->cap ? t->cap * 2 : 4;
+    uint32_t* ids = realloc(t->ids, cap * sizeof(uint32_t));
+    if (!ids) {
+      return 0;
+    }
+    t->ids = ids;
+    t->cap = cap;
+  }
+  t->ids[t->n++] = id;
+  return 1;
+}
+
+/* history_index - Add entry id to the trigram index. On running out
+ *    of memory the index is dropped, and searches scan.
+ */
+static void history_index(uint32_t id) {
+  size_t len;
+  const char* text = history_entry(id, &len);
+  int ok = 1;
+  for (int n = 1; n <= 3 && n <= (int) len; n++) {
+    ok &= tri_post(trikey(text, n, 1), id);
+  }
+  for (size_t i = 0; ok && i + 3 <= len; i++) {
+    ok &= tri_post(trikey(text + i, 3, 0), id);
+  }
+  if (!ok) {
+    tri_free();
+  }
+}
+
+/*
+ * history_add - Append a command line to the history, writing the
+ *    buffered lines out once there are HISTORY_FLUSH bytes of them.
+ */
+void history_add(const char* line) {
+  size_t len = strcspn(line, "\n");
+  if (line[strspn(line, " \t")] == '\n' || len == 0) { /* blank */
+    return;
+  }
+  if (history.sesslen + len + 1 > history.sesscap) {
+    size_t cap = history.sesscap ? history.sesscap : HISTORY_FLUSH;
+    while (cap < history.sesslen + len + 1) {
+      cap *= 2;
+    }
+    char* sess = realloc(history.sess, cap);
+    if (!sess) {
+      return;
+    }
+    history.sess = sess;
+    history.sesscap = cap;
+  }
+  size_t off = history.maplen + history.sesslen;
+  memcpy(history.sess + history.sesslen, line, len);
+  history.sess[history.sesslen + len] = '\n';
+  history.sesslen += len + 1;
+
+  if (history.starts && !history_addstart(off)) {
+    tri_free(); /* the index can no longer be kept up */
+    free(history.starts);
+    history.starts = NULL;
+    history.nentries = history.startcap = 0;
+  } else if (history.tri) { /* built only once the entries were */
+    history_index(history.nentries - 1);
+  }
+  if (history.sesslen - history.written >= HISTORY_FLUSH) {
+    history_flush();
+  }
+}
+
+/* history_flush - Write out the lines not yet in the file. */
+void history_flush(void) {
+  while (history.fd >= 0 && history.written < history.sesslen) {
+    ssize_t n = write(history.fd, history.sess + history.written,
+                      history.sesslen - history.written);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) { /* e.g. a full disk: stop keeping it */
+      history.fd = -1;
+      break;
+    }
+    history.written += n;
+  }
+}
+
+/* history_match - Does entry id start with, or contain, q? */
+static int history_match(uint32_t id, const char* q, size_t qlen,
+                         int prefix) {
+  size_t len;
+  const char* text = history_entry(id, &len);
+  return prefix ? len >= qlen && !memcmp(text, q, qlen)
+                : memmem(text, len, q, qlen) != NULL;
+}
+
+/*
+ * history_search - Print the entries that start with q (prefix) or
+ *    contain it, through the trigram index where it can narrow them.
+ */
+static void history_search(const char* q, int prefix, FILE* out) {
+  size_t qlen = strlen(q);
+  if (!history.tri && (prefix || qlen >= 3)) { /* built on first use */
+    history.tri = calloc(1024, sizeof(trigram_t));
+    history.tricap = history.tri ? 1024 : 0;
+    for (uint32_t id = 0; history.tri && id < history.nentries; id++) {
+      history_index(id);
+    }
+  }
+
+  /* candidates: the shortest posting list among the query's keys */
+  trigram_t* best = NULL;
+  int keyed = history.tri && qlen > 0 && (prefix || qlen >= 3);
+  if (keyed && prefix) {
+    best = tri_slot(trikey(q, qlen < 3 ? qlen : 3, 1));
+  }
+  for (size_t i = 0; keyed && i + 3 <= qlen; i++) {
+    trigram_t* t = tri_slot(trikey(q + i, 3, 0));
+    if (!best || t->n < best->n) {
+      best = t;
+    }
+  }
+
+  uint32_t n = keyed ? best->n : history.nentries;
+  for (uint32_t k = 0; k < n; k++) {
+    uint32_t id = keyed ? best->ids[k] : k;
+    if (history_match(id, q, qlen, prefix)) {
+      size_t len;
+      const char* text = history_entry(id, &len);
+      fprintf(out, "%5u  %.*s\n", id + 1, (int) len, text);
+    }
+  }
+}
+
+/*
+ * do_history - history [N | -p prefix | -s text]: list the history,
+ *    or its last N entries, or search it for entries that start with
+ *    prefix or contain text. The words after -p or -s are the query,
+ *    joined by single spaces.
+ */
+int do_history(char** argv, FILE* out) {
+  if (history.fd < 0 && !history.sesslen) {
+    printf("history: no history is kept\n");
+    return 1;
+  }
+  if (!history_lines()) {
+    printf("history: out of memory\n");
+    return 1;
+  }
+
+  if (argv[1] && (!strcmp(argv[1], "-p") || !strcmp(argv[1], "-s"))) {
+    if (!argv[2]) {
+      printf("usage: history [N | -p prefix | -s text]\n");
+      return 2;
+    }
+    size_t len = 0;
+    for (int i = 2; argv[i]; i++) {
+      len += strlen(argv[i]) + 1;
+    }
+    char q[len];
+    q[0] = '\0';
+    for (int i = 2; argv[i]; i++) {
+      strcat(i > 2 ? strcat(q, " ") : q, argv[i]);
+    }
+    history_search(q, argv[1][1] == 'p', out);
+    return 0;
+  }
+
+  uint32_t first = 0;
+  if (argv[1]) {
+    char* end;
+    long n = strtol(argv[1], &end, 10);
+    if (*end || n < 0) {
+      printf("usage: history [N | -p prefix | -s text]\n");
+      return 2;
+    }
+    first = (uint32_t) n < history.nentries ? history.nentries - n : 0;
+  }
+  for (uint32_t id = first; id < history.nentries; id++) {
+    size_t len;
+    const char* text = history_entry(id, &len);
+    fprintf(out, "%5u  %.*s\n", id + 1, (int) len, text);
+  }
+  return 0;
+}
+
+/********************************
+ * Line editor and tab completion
+ ********************************/
+
+/*
+ * When the shell prompts on a terminal, lines are read by a small
+ * editor with the terminal in raw mode, which it is in only while a
+ * line is being typed: jobs always run with the terminal as the shell
+ * found it. The editor keeps the line on one row, and knows the usual
+ * keys: arrows, home and end, backspace and delete, ctrl-a, -e, -k,
+ * -u, -w and -l, ctrl-c to drop the line, ctrl-d to end input, and up
+ * and down to step through the history. setopt edit off reads lines
+ * as they come instead.
+ *
+ * Tab completes the word before the cursor: a %jobid from the job
+ * table, a pid from it in argument position, a command name in
+ * command position (first, or after a |), and a file name otherwise.
+ * Command names come from a trie of the builtins and the executables
+ * in the PATH directories, built on the first tab. Each later tab
+ * stats the directories, and a directory whose mtime changed has its
+ * names dropped and reloaded, leaving the others alone. Each node
+ * counts the names at or below it, so finding the completion, and the
+ * longest common extension of an ambiguous one, takes time in the
+ * length of the word, whatever the size of the directories. A second
+ * tab on an ambiguous word lists the candidates. The compgen builtin
+ * prints the candidates for a word, so completion can be tried
+ * without a terminal.
+ */
+
+/* The line being edited */
+typedef struct editor_t {
+    char* buf;              /* the line; room for a '\n' and NUL more */
+    size_t cap;
+    size_t len;
+    size_t pos;             /* the cursor */
+    int lasttab;            /* the last key was a tab */
+    uint32_t histpos;       /* history entry shown, nentries for none */
+} editor_t;
+
+/* Candidate completions of a word */
+typedef struct cands_t {
+    char** v;
+    int n;
+    int cap;
+} cands_t;
+
+editor_t ed;
+
+/* initeditor - Edit lines if the shell prompts for commands typed at
+ *    a terminal (interactive), and the terminal can take it.
+ */
+void initeditor(int interactive) {
+  const char* term = env_get("TERM");
+  edit_ok = interactive && isatty(STDIN_FILENO) && isatty(STDOUT_FILENO)
+      && !(term && !strcmp(term, "dumb"));
+  edit_mode = edit_ok;
+}
+
+/* trie_newnode - Add a node for ch with no children. Returns its
+ *    index, or -1 if out of memory.
+ */
+static int trie_newnode(char ch) {
+  if (comptrie.n == comptrie.cap) {
+    int cap = comptrie.cap ? comptrie.cap * 2 : 4096;
+    trienode_t* nodes = realloc(comptrie.nodes, cap * sizeof(trienode_t));
+    if (!nodes) {
+      return -1;
+    }
+    comptrie.nodes = nodes;
+    comptrie.cap = cap;
+  }
+  trienode_t* t = &comptrie.nodes[comptrie.n];
+  t->child = t->sibling = -1;
+  t->live = 0;
+  t->ch = ch;
+  t->dirs = 0;
+  return comptrie.n++;
+}
+
+/* trie_child - The child of node for ch, added (children are kept in
+ *    byte order) if create is set. Returns -1 if there is none.
+ */
+static int trie_child(int node, char ch, int create) {
+  trienode_t* t = comptrie.nodes;
+  int prev = -1;
+  int c = t[node].child;
+  while (c >= 0 && (unsigned char) t[c].ch < (unsigned char) ch) {
+    prev = c;
+    c = t[c].sibling;
+  }
+  if (c >= 0 && t[c].ch == ch) {
+    return c;
+  }
+  int k = create ? trie_newnode(ch) : -1;
+  if (k >= 0) {
+    t = comptrie.nodes; /* may have moved */
+    t[k].sibling = c;
+    if (prev >= 0) {
+      t[prev].sibling = k;
+    } else {
+      t[node].child = k;
+    }
+  }
+  return k;
+}
+
+/* trie_insert - Note that name is found where bit says. */
+static void trie_insert(const char* name, unsigned long long bit) {
+  int path[NAME_MAX + 1];
+  int depth = 0;
+  int node = 0;
+  for (const char* p = name; *p; p++) {
+    if (depth == NAME_MAX || (node = trie_child(node, *p, 1)) < 0) {
+      return;
+    }
+    path[depth++] = node;
+  }
+  trienode_t* t = comptrie.nodes;
+  if (!t[node].dirs) { /* a new name: count it on the way down */
+    t[0].live++;
+    for (int i = 0; i < depth; i++) {
+      t[path[i]].live++;
+    }
+  }
+  t[node].dirs |= bit;
+}
+
+/* trie_drop - Forget that names below node are where bit says, and
+ *    recount them. Returns the count.
+ */
+static int trie_drop(int node, unsigned long long bit) {
+  trienode_t* t = comptrie.nodes;
+  t[node].dirs &= ~bit;
+  int live = t[node].dirs != 0;
+  for (int c = t[node].child; c >= 0; c = t[c].sibling) {
+    live += trie_drop(c, bit);
+  }
+  return t[node].live = live;
+}
+
+/* trie_loaddir - Add the executables in PATH directory i. */
+static void trie_loaddir(int i) {
+  DIR* d = opendir(comptrie.dirs[i].dir);
+  struct dirent* e;
+  while (d && (e = readdir(d))) {
+    struct stat sb;
+    if (e->d_name[0] == '.' || e->d_type == DT_DIR
+        || (e->d_type != DT_REG
+            && (fstatat(dirfd(d), e->d_name, &sb, 0) < 0
+                || !S_ISREG(sb.st_mode)))) {
+      continue;
+    }
+    if (faccessat(dirfd(d), e->d_name, X_OK, 0) == 0) {
+      trie_insert(e->d_name, 1ULL << i);
+    }
+  }
+  if (d) {
+    closedir(d);
+  }
+}
+
+/* trie_refresh - Bring the trie up to date with PATH: rebuilt if PATH
+ *    changed, otherwise reloading only the directories whose mtime did.
+ */
+static void trie_refresh(void) {
+  const char* pathvar = env_get("PATH");
+  if (!pathvar) {
+    pathvar = DEFAULT_PATH;
+  }
+  if (!comptrie.pathvar || strcmp(pathvar, comptrie.pathvar)) {
+    for (int i = 0; i < comptrie.ndirs; i++) {
+      free(comptrie.dirs[i].dir);
+    }
+    free(comptrie.dirs);
+    free(comptrie.pathvar);
+    comptrie.pathvar = strdup(pathvar);
+    comptrie.dirs = split_path(pathvar, &comptrie.ndirs);
+    if (comptrie.ndirs > TRIE_DIRS) {
+      comptrie.ndirs = TRIE_DIRS; /* the rest go uncompleted */
+    }
+    comptrie.n = 0;
+    trie_newnode(0);
+    for (int i = 0; i < BUILTIN_SLOTS; i++) {
+      if (builtins[i].name) {
+        trie_insert(builtins[i].name, TRIE_BUILTIN);
+      }
+    }
+    trie_insert("time", TRIE_BUILTIN);
+    trie_insert("timeout", TRIE_BUILTIN);
+    trie_insert("after", TRIE_BUILTIN);
+    for (int i = 0; i < comptrie.ndirs; i++) {
+      trie_loaddir(i);
+    }
+    return;
+  }
+  for (int i = 0; i < comptrie.ndirs; i++) {
+    struct stat sb;
+    struct timespec mtime = {0, 0};
+    if (stat(comptrie.dirs[i].dir, &sb) == 0) {
+      mtime = sb.st_mtim;
+    }
+    if (mtime.tv_sec != comptrie.dirs[i].mtime.tv_sec
+        || mtime.tv_nsec != comptrie.dirs[i].mtime.tv_nsec) {
+      comptrie.dirs[i].mtime = mtime;
+      trie_drop(0, 1ULL << i);
+      trie_loaddir(i);
+    }
+  }
+}
+
+/* cands_add - Add a candidate completion. */
+static void cands_add(cands_t* c, const char* s) {
+  if (c->n == c->cap) {
+    int cap = c->cap ? c->cap * 2 : 16;
+    char** v = realloc(c->v, cap * sizeof(char*));
+    if (!v) {
+      return;
+    }
+    c->v = v;
+    c->cap = cap;
+  }
+  if ((c->v[c->n] = strdup(s))) {
+    c->n++;
   }
 }
 
-/* maxjid - Returns largest allocated job ID */
-int maxjid(job_t* jobs) {
-  int max = 0;
-  for (int i = 0; i < MAXJOBS; i++) {
-    if (jobs[i].jid > max) {
-      max = jobs[i].jid;
+/* trie_find - The node that spells word, with the trie brought up to
+ *    date first, or -1 if no command name starts with it.
+ */
+static int trie_find(const char* word, size_t wlen) {
+  trie_refresh();
+  int node = comptrie.n > 0 ? 0 : -1;
+  for (size_t i = 0; i < wlen && node >= 0; i++) {
+    node = trie_child(node, word[i], 0);
+  }
+  return node >= 0 && comptrie.nodes[node].live > 0 ? node : -1;
+}
+
+/* trie_collect - Add the names at or below node, which spell name so
+ *    far, to c, stopping past max of them.
+ */
+static void trie_collect(int node, char* name, size_t len, cands_t* c,
+                         int max) {
+  trienode_t* t = comptrie.nodes;
+  if (t[node].dirs) {
+    name[len] = '\0';
+    cands_add(c, name);
+  }
+  for (int k = t[node].child; k >= 0 && c->n <= max; k = t[k].sibling) {
+    if (t[k].live && len + 1 < PATH_MAX) {
+      name[len] = t[k].ch;
+      trie_collect(k, name, len + 1, c, max);
     }
   }
-  return max;
 }
 
-/* addjob - Add a job to the job list. Return true if
- *    the job was successfully added or false otherwise.
+/* cands_cmp - qsort order of candidates. */
+static int cands_cmp(const void* a, const void* b) {
+  return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+/* edit_redraw - Redraw the prompt and the line, and place the cursor. */
+static void edit_redraw(void) {
+  char back[32];
+  out_write("\r", 1);
+  out_write(prompt, strlen(prompt));
+  out_write(ed.buf, ed.len);
+  out_write("\x1b[K", 3);
+  if (ed.pos < ed.len) {
+    out_write(back, snprintf(back, sizeof(back), "\x1b[%zuD",
+                              ed.len - ed.pos));
+  }
+}
+
+/* edit_insert - Insert n bytes at the cursor. */
+static void edit_insert(const char* s, size_t n) {
+  if (ed.len + n + 2 > ed.cap) {
+    size_t cap = ed.cap;
+    while (ed.len + n + 2 > cap) {
+      cap *= 2;
+    }
+    char* buf = realloc(ed.buf, cap);
+    if (!buf) {
+      return;
+    }
+    ed.buf = buf;
+    ed.cap = cap;
+  }
+  memmove(ed.buf + ed.pos + n, ed.buf + ed.pos, ed.len - ed.pos);
+  memcpy(ed.buf + ed.pos, s, n);
+  ed.len += n;
+  ed.pos += n;
+}
+
+/* edit_delete - Delete the bytes [from, to) of the line. */
+static void edit_delete(size_t from, size_t to) {
+  memmove(ed.buf + from, ed.buf + to, ed.len - to);
+  ed.len -= to - from;
+  ed.pos = ed.pos > to ? ed.pos - (to - from) : ed.pos > from ? from
+         : ed.pos;
+}
+
+/* edit_history - Show history entry id, or an empty line for the entry
+ *    past the last.
  */
-int addjob(job_t* jobs, pid_t pid, int state, char* cmdline) {
-  /* pid must be >0 */
-  if (pid < 1) {
-    return 0;
+static void edit_history(uint32_t id) {
+  size_t len = 0;
+  const char* text = id < history.nentries ? history_entry(id, &len) : "";
+  ed.histpos = id;
+  ed.len = ed.pos = 0;
+  edit_insert(text, len);
+}
+
+/* edit_files - The files in the word's directory whose names start
+ *    with the rest of it, as the word would become; directories get a
+ *    '/'. Returns how much of each is the directory part.
+ */
+static size_t edit_files(const char* word, cands_t* c) {
+  const char* slash = strrchr(word, '/');
+  size_t dirlen = slash ? (size_t) (slash - word) + 1 : 0;
+  const char* base = word + dirlen;
+  size_t baselen = strlen(base);
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%.*s", dirlen ? (int) dirlen : 1,
+           dirlen ? word : ".");
+  DIR* d = opendir(path);
+  struct dirent* e;
+  while (d && (e = readdir(d))) {
+    struct stat sb;
+    if ((e->d_name[0] == '.' && base[0] != '.')
+        || !strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")
+        || strncmp(e->d_name, base, baselen)) {
+      continue;
+    }
+    int isdir = e->d_type == DT_DIR
+        || ((e->d_type == DT_LNK || e->d_type == DT_UNKNOWN)
+            && fstatat(dirfd(d), e->d_name, &sb, 0) == 0
+            && S_ISDIR(sb.st_mode));
+    snprintf(path, sizeof(path), "%.*s%s%s", (int) dirlen, word,
+             e->d_name, isdir ? "/" : "");
+    cands_add(c, path);
   }
-  /* find an available slot in the job list */
-  for (int i = 0; i < MAXJOBS; i++) {
-    if (jobs[i].pid == 0) {
-      jobs[i].pid = pid;
-      jobs[i].state = state;
-      jobs[i].jid = nextjid++;
-      if (nextjid > MAXJOBS) {
-        nextjid = 1;
-      }
-      strcpy(jobs[i].cmdline, cmdline);
-      if (verbose) {
-        printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
+  if (d) {
+    closedir(d);
+  }
+  return dirlen;
+}
+
+/* complete_args - What a word that is not a command name could become:
+ *    a %jobid, a pid of a job if it is all digits in argument position,
+ *    or else a file. Returns what listings leave off each candidate.
+ */
+static size_t complete_args(const char* word, int cmdpos, cands_t* c) {
+  size_t wlen = strlen(word);
+  char num[32];
+  if (word[0] != '%' && (cmdpos || wlen == 0
+                         || strspn(word, "0123456789") != wlen)) {
+    return edit_files(word, c);
+  }
+  for (int jid = 1; jid <= jobs.maxjid; jid++) {
+    job_t* job = &jobs.slots[jid - 1];
+    if (job->state != UNDEF && (word[0] == '%' || job->pid > 0)) {
+      snprintf(num, sizeof(num), word[0] == '%' ? "%%%d" : "%d",
+               word[0] == '%' ? job->jid : job->pid);
+      if (!strncmp(num, word, wlen)) {
+        cands_add(c, num);
       }
-      return 1;
     }
   }
-  /* no available slots in the job list */
-  printf("Tried to create too many jobs\n");
   return 0;
 }
 
-/* deletejob - Delete a job with the given pid from the job list. Return true
- *    if the job was deleted or false otherwise.
+/*
+ * edit_complete - Complete the word before the cursor as far as it
+ *    goes; when it is ambiguous and goes no further, beep, or on the
+ *    second tab in a row list the candidates.
  */
-int deletejob(job_t* jobs, pid_t pid) {
-  /* pid must be >0 */
-  if (pid < 1) {
-    return 0;
+static void edit_complete(void) {
+  size_t start = ed.pos;
+  while (start > 0 && ed.buf[start - 1] != ' ' && ed.buf[start - 1] != '|') {
+    start--;
   }
-  /* find the specified pid in the job list */
-  for (int i = 0; i < MAXJOBS; i++) {
-    if (jobs[i].pid == pid) {
-      clearjob(&jobs[i]);
-      nextjid = maxjid(jobs)+1;
-      return 1;
+  size_t before = start;
+  while (before > 0 && ed.buf[before - 1] == ' ') {
+    before--;
+  }
+  int cmdpos = before == 0 || ed.buf[before - 1] == '|';
+  char word[PATH_MAX];
+  char ext[PATH_MAX];
+  size_t wlen = ed.pos - start;
+  size_t elen = 0;
+  size_t skip = 0; /* what listings leave off each candidate */
+  int unique = 0;
+  cands_t c = { NULL, 0, 0 };
+  if (wlen >= sizeof(word)) {
+    return;
+  }
+  memcpy(word, ed.buf + start, wlen);
+  word[wlen] = '\0';
+
+  if (cmdpos && word[0] != '%' && !strchr(word, '/')) { /* the trie */
+    int node = trie_find(word, wlen);
+    trienode_t* t = comptrie.nodes;
+    if (node >= 0) {
+      while (!t[node].dirs && elen + 1 < sizeof(ext)) { /* one way on */
+        int only = -1;
+        for (int k = t[node].child; k >= 0; k = t[k].sibling) {
+          if (t[k].live) {
+            only = only < 0 ? k : -2;
+          }
+        }
+        if (only < 0) {
+          break;
+        }
+        ext[elen++] = t[only].ch;
+        node = only;
+      }
+      unique = t[node].dirs && t[node].live == 1;
+      if (!unique && elen == 0 && ed.lasttab) {
+        char name[PATH_MAX];
+        memcpy(name, word, wlen);
+        trie_collect(node, name, wlen, &c, COMPLETE_LIST);
+      }
+    }
+  } else {
+    skip = complete_args(word, cmdpos, &c);
+    if (c.n > 0) { /* the longest extension they all share */
+      size_t lcp = strlen(c.v[0]);
+      for (int i = 1; i < c.n; i++) {
+        size_t k = wlen;
+        while (k < lcp && c.v[i][k] == c.v[0][k]) {
+          k++;
+        }
+        lcp = k;
+      }
+      elen = lcp - wlen;
+      memcpy(ext, c.v[0] + wlen, elen);
+      unique = c.n == 1;
     }
   }
-  /* no job with the specified pid */
-  return 0;
+
+  if (elen > 0) {
+    edit_insert(ext, elen);
+  }
+  if (unique && (elen == 0 || ext[elen - 1] != '/')) {
+    edit_insert(" ", 1);
+  }
+  if (!unique && elen == 0 && ed.lasttab && c.n > 0) { /* list them */
+    qsort(c.v, c.n, sizeof(char*), cands_cmp);
+    out_write("\r\n", 2);
+    for (int i = 0; i < c.n && i < COMPLETE_LIST; i++) {
+      out_write(c.v[i] + skip, strlen(c.v[i] + skip));
+      out_write("  ", 2);
+    }
+    if (c.n > COMPLETE_LIST) {
+      out_write("...", 3);
+    }
+    out_write("\r\n", 2);
+  } else if (!unique && elen == 0) {
+    out_write("\a", 1);
+  }
+  for (int i = 0; i < c.n; i++) {
+    free(c.v[i]);
+  }
+  free(c.v);
 }
 
-/* fgpid - Return PID of current foreground job or 0 if there is no
- *    foreground job.
+/*
+ * do_compgen - compgen [-c] [word]: print what tab would offer for
+ *    word, one per line in order: with -c the command names that start
+ *    with it, otherwise the jobs, pids or files it could become.
+ *    Returns 1 if there are none.
  */
-pid_t fgpid(job_t* jobs) {
-  /* look for a foreground job in the job list */
-  for (int i = 0; i < MAXJOBS; i++) {
-    if (jobs[i].state == FG) {
-      return jobs[i].pid;
+int do_compgen(char** argv, FILE* out) {
+  int cmd = argv[1] && !strcmp(argv[1], "-c");
+  const char* word = argv[1 + cmd] ? argv[1 + cmd] : "";
+  size_t wlen = strlen(word);
+  cands_t c = { NULL, 0, 0 };
+  if (argv[1 + cmd] && argv[2 + cmd]) {
+    printf("usage: compgen [-c] [word]\n");
+    return 2;
+  }
+
+  if (cmd) {
+    int node = wlen < PATH_MAX ? trie_find(word, wlen) : -1;
+    char name[PATH_MAX];
+    if (node >= 0) {
+      memcpy(name, word, wlen);
+      trie_collect(node, name, wlen, &c, INT_MAX);
     }
+  } else {
+    complete_args(word, 0, &c);
   }
-  /* no foreground job in the job list */
-  return 0;
+  qsort(c.v, c.n, sizeof(char*), cands_cmp);
+  for (int i = 0; i < c.n; i++) {
+    fprintf(out, "%s\n", c.v[i]);
+    free(c.v[i]);
+  }
+  free(c.v);
+  return c.n == 0;
 }
 
-/* getjobpid - Find a job (by PID) on the job list. Return the
- *    matching job or NULL if not found.
+/* edit_getc - The next byte typed, or -1 at end of input. */
+static int edit_getc(void) {
+  unsigned char ch;
+  ssize_t n;
+  do {
+    if (event_mode) { /* signals are dispatched while we wait */
+      while (!event_wait(1, -1)) {
+        ;
+      }
+    } else {
+      input_wait(STDIN_FILENO);
+    }
+    n = read(STDIN_FILENO, &ch, 1);
+  } while (n < 0 && errno == EINTR);
+  return n == 1 ? ch : -1;
+}
+
+/*
+ * edit_readline - Read a command line with the editor. Returns it as
+ *    input_readline does, or NULL at end of input.
  */
-job_t* getjobpid(job_t* jobs, pid_t pid) {
-  /* pid must be >0 */
-  if (pid < 1) {
-    return NULL;
+char* edit_readline(void) {
+  struct termios cooked, raw;
+  if (input.start < input.end || tcgetattr(STDIN_FILENO, &cooked) < 0) {
+    return input_readline(&input); /* lines already read, e.g. pasted */
+  }
+  raw = cooked;
+  raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+  raw.c_iflag &= ~(IXON | ICRNL | INLCR);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+  if (!ed.buf && !(ed.buf = malloc(ed.cap = 256))) {
+    error("edit_readline: out of memory");
   }
-  /* look for specified pid in the job list */
-  for (int i = 0; i < MAXJOBS; i++) {
-    if (jobs[i].pid == pid) {
-      return &jobs[i];
+  ed.len = ed.pos = 0;
+  ed.lasttab = 0;
+  ed.histpos = history_lines() ? history.nentries : 0;
+
+  char* line = NULL;
+  int done = 0;
+  while (!done) {
+    int c = edit_getc();
+    int tab = 0;
+    switch (c) {
+      case -1:                  /* end of input */
+        done = 1;
+        break;
+      case 4:                   /* ctrl-d: end of input on an empty line */
+        if (ed.len == 0) {
+          out_write("\r\n", 2);
+          done = 1;
+        } else if (ed.pos < ed.len) {
+          edit_delete(ed.pos, ed.pos + 1);
+        }
+        break;
+      case '\r':
+      case '\n':
+        out_write("\r\n", 2);
+        ed.buf[ed.len++] = '\n';
+        line = ed.buf;
+        done = 1;
+        break;
+      case 3:                   /* ctrl-c: drop the line */
+        out_write("^C\r\n", 4);
+        ed.len = ed.pos = 0;
+        ed.histpos = history.nentries;
+        break;
+      case 127:
+      case 8:                   /* backspace */
+        if (ed.pos > 0) {
+          edit_delete(ed.pos - 1, ed.pos);
+        }
+        break;
+      case 1:                   /* ctrl-a */
+        ed.pos = 0;
+        break;
+      case 5:                   /* ctrl-e */
+        ed.pos = ed.len;
+        break;
+      case 11:                  /* ctrl-k: delete to the end */
+        ed.len = ed.pos;
+        break;
+      case 21:                  /* ctrl-u: delete to the start */
+        edit_delete(0, ed.pos);
+        break;
+      case 23: {                /* ctrl-w: delete the word before */
+        size_t from = ed.pos;
+        while (from > 0 && ed.buf[from - 1] == ' ') {
+          from--;
+        }
+        while (from > 0 && ed.buf[from - 1] != ' ') {
+          from--;
+        }
+        edit_delete(from, ed.pos);
+        break;
+      }
+      case 12:                  /* ctrl-l: clear the screen */
+        out_write("\x1b[H\x1b[2J", 7);
+        break;
+      case '\t': {             /* a tab that completes nothing counts */
+        size_t len = ed.len;
+        edit_complete();
+        tab = ed.len == len;
+        break;
+      }
+      case 27: {                /* an escape sequence: arrows and such */
+        int c1 = edit_getc();
+        int c2 = c1 == '[' || c1 == 'O' ? edit_getc() : -1;
+        if (c2 >= '0' && c2 <= '9' && edit_getc() != '~') {
+          break;
+        }
+        if (c2 == 'A' && ed.histpos > 0) {
+          edit_history(ed.histpos - 1);
+        } else if (c2 == 'B' && ed.histpos < history.nentries) {
+          edit_history(ed.histpos + 1);
+        } else if (c2 == 'C' && ed.pos < ed.len) {
+          ed.pos++;
+        } else if (c2 == 'D' && ed.pos > 0) {
+          ed.pos--;
+        } else if (c2 == 'H' || c2 == '1') {
+          ed.pos = 0;
+        } else if (c2 == 'F' || c2 == '4') {
+          ed.pos = ed.len;
+        } else if (c2 == '3' && ed.pos < ed.len) {
+          edit_delete(ed.pos, ed.pos + 1);
+        }
+        break;
+      }
+      default:
+        if (c >= ' ') {
+          char ch = c;
+          edit_insert(&ch, 1);
+        }
+        break;
     }
+    ed.lasttab = tab;
+    if (!done) {
+      edit_redraw();
+    }
+    out_flush(); /* the key's echo, in one write */
   }
-  /* didn't find the specified pid */
-  return NULL;
+
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked);
+  if (line) {
+    line[ed.len] = '\0';
+  }
+  return line;
 }
 
-/* getjobjid - Find a job (by JID) on the job list. Return the
- *    matching job or NULL if not found.
+/*********************************************
+ * Event-driven core (-e): signalfd and pidfd
+ *********************************************/
+
+/*
+ * With -e, SIGCHLD, SIGINT, SIGTSTP and SIGALRM stay blocked and arrive through
+ * a signalfd, each job's exit is signalled through a pidfd, and both
+ * are multiplexed with stdin on one epoll instance. The signal
+ * handlers then run as ordinary functions from the main loop, so the
+ * job list is never touched asynchronously, and each wakeup costs
+ * work proportional to the events delivered, not to the job count.
  */
-job_t* getjobjid(job_t* jobs, int jid) {
-  /* jid must be >0 */
-  if (jid < 1) {
-    return NULL;
+
+/* initevents - Switch the shell to the event-driven core. */
+void initevents(void) {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTSTP);
+  sigaddset(&mask, SIGALRM);
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+    error("sigprocmask error");
+  }
+  if ((sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+    error("signalfd error");
   }
-  /* look for specified jid in the job list */
-  for (int i = 0; i < MAXJOBS; i++) {
-    if (jobs[i].jid == jid) {
-      return &jobs[i];
+  if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    error("epoll_create1 error");
+  }
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.u64 = EV_SIGNAL;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev) < 0) {
+    error("epoll_ctl error");
+  }
+  ev.data.u64 = EV_STDIN;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == 0) {
+    stdin_watched = 1;
+  } else if (errno == EPERM) {
+    stdin_watched = -1; /* a regular file: always readable */
+  } else {
+    error("epoll_ctl error");
+  }
+  event_mode = 1;
+}
+
+/* watchexit - Have the event loop hear about pid's exit through a
+ *    pidfd. Returns the pidfd, or -1 if pidfds are unavailable, in
+ *    which case SIGCHLD alone reports the exit.
+ */
+int watchexit(pid_t pid) {
+  int fd = -1;
+#ifdef SYS_pidfd_open
+  fd = syscall(SYS_pidfd_open, pid, 0); /* close-on-exec by default */
+  if (fd >= 0) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = EV_PIDTAG | (unsigned int) pid;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      close(fd);
+      fd = -1;
     }
   }
-  /* didn't find the specified jid */
-  return NULL;
+#endif
+  return fd;
 }
 
-/* pid2jid - Find the job ID of the job with the specified
- *    process ID. Return 0 if not found.
+/* reap_pid - Collect pid if it has exited or stopped. */
+static void reap_pid(pid_t pid) {
+  int status;
+  struct rusage ru;
+  if (wait4(pid, &status, WNOHANG | WUNTRACED, &ru) > 0) {
+    reap_status(pid, status, &ru);
+  }
+}
+
+/*
+ * event_wait - Wait for and dispatch one batch of events, or until
+ *    timeout_ms passes (-1: no limit). If want_stdin is set, returns
+ *    true once stdin is readable; otherwise stdin is left alone so a
+ *    waiting foreground job doesn't spin the loop.
  */
-int pid2jid(pid_t pid) {
-  /* pid must be >0 */
-  if (pid < 1) {
-    return 0;
+int event_wait(int want_stdin, int timeout_ms) {
+  if (stdin_watched == -1) {
+    if (want_stdin) {
+      return 1;
+    }
+  } else if (stdin_watched != want_stdin) {
+    struct epoll_event ev;
+    ev.events = want_stdin ? EPOLLIN : 0;
+    ev.data.u64 = EV_STDIN;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, STDIN_FILENO, &ev) < 0) {
+      error("epoll_ctl error");
+    }
+    stdin_watched = want_stdin;
+  }
+
+  struct epoll_event evs[EVENT_BATCH];
+  int n = epoll_wait(epfd, evs, EVENT_BATCH, timeout_ms);
+  if (n < 0) {
+    if (errno == EINTR) {
+      return 0;
+    }
+    error("epoll_wait error");
   }
-  /* look for specified pid in the job list */
-  for (int i = 0; i < MAXJOBS; i++) {
-    if (jobs[i].pid == pid) {
-      return jobs[i].jid;
+
+  int readable = 0;
+  for (int i = 0; i < n; i++) {
+    unsigned long long tag = evs[i].data.u64;
+    if (tag == EV_STDIN) {
+      readable = 1;
+    } else if (tag == EV_TOKEN) {
+      admit_queued();
+    } else if (tag == EV_SIGNAL) {
+      struct signalfd_siginfo si;
+      while (read(sigfd, &si, sizeof(si)) == sizeof(si)) {
+        switch (si.ssi_signo) {
+          case SIGCHLD:
+            sigchld_handler(SIGCHLD);
+            break;
+          case SIGINT:
+            sigint_handler(SIGINT);
+            break;
+          case SIGTSTP:
+            sigtstp_handler(SIGTSTP);
+            break;
+          case SIGALRM:
+            sigalrm_handler(SIGALRM);
+            break;
+        }
+      }
+    } else {
+      reap_pid((pid_t) (tag & ~EV_PIDTAG));
     }
   }
-  /* didn't find the specified pid */
-  return 0;
+  return readable;
 }
 
-/* listjobs - Print the job list */
-void listjobs(job_t* jobs) {
-  for (int i = 0; i < MAXJOBS; i++) {
-    if (jobs[i].pid != 0) {
-      printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
-      switch (jobs[i].state) {
-        case BG: 
-          printf("Running ");
-          break;
-        case FG: 
-          printf("Foreground ");
-          break;
-        case ST: 
-          printf("Stopped ");
-          break;
-        default:
-          printf("listjobs: Internal error: job[%d].state=%d ", 
-              i, jobs[i].state);
-          break;
+/********
+ * Output
+ ********/
+
+/*
+ * Everything the shell prints goes through one ring of bytes, in the
+ * order it was printed, and out to fd 1 with one writev: stdout is a
+ * stream whose writes add to the ring, and safe_printf, which signal
+ * handlers use, adds to it too. A writer checks for room and claims
+ * it in one compare-and-swap, so a handler that interrupts the main
+ * line mid-printf takes the space after it, and the two never share
+ * bytes or overrun the ring. The main loop writes the ring out once
+ * per command, just before it reads the next one (with the prompt),
+ * and it is also written before a child is launched, before stdout is
+ * redirected, when it fills and at exit.
+ * A handler writes it out itself, unless it interrupted the main line
+ * adding or writing, as the main line may be blocked for a while;
+ * either way the order holds. Handlers keep OUT_SLACK bytes to
+ * themselves, and only when even those are gone is a message written
+ * straight out, ahead of what is waiting.
+ */
+
+/* out_cookie_write - The write function of the stdout stream. */
+static ssize_t out_cookie_write(void* cookie, const char* s, size_t n) {
+  out_write(s, n);
+  return n;
+}
+
+/* initoutput - Point stdout at the ring. It is unbuffered, so that each
+ *    printf adds its text to the ring whole, right away.
+ */
+void initoutput(void) {
+  cookie_io_functions_t io = { NULL, out_cookie_write, NULL, NULL };
+  FILE* f = fopencookie(NULL, "w", io);
+  if (f) {
+    setvbuf(f, NULL, _IONBF, 0);
+    stdout = f;
+  }
+}
+
+/* ring_put - Add n bytes to a ring, if that leaves no more than limit
+ *    bytes in it. The room is checked and claimed in one atomic step,
+ *    so a handler that interrupts can't claim it too. Returns false,
+ *    adding nothing, if they don't fit.
+ */
+int ring_put(ring_t* r, const char* s, size_t n, size_t limit) {
+  unsigned long at = r->head;
+  do {
+    if (at + n - r->tail > limit) {
+      return 0;
+    }
+  } while (!__atomic_compare_exchange_n(&r->head, &at, at + n, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+  size_t from = at % r->size;
+  size_t first = n < r->size - from ? n : r->size - from;
+  memcpy(r->buf + from, s, first);
+  memcpy(r->buf, s + first, n - first);
+  return 1;
+}
+
+/* ring_flush - Write out a ring, unless it is being added to or
+ *    written already (by whatever this interrupted). Bytes that can't
+ *    be written are dropped.
+ */
+void ring_flush(ring_t* r) {
+  if (__atomic_exchange_n(&r->busy, 1, __ATOMIC_SEQ_CST)) {
+    return;
+  }
+  unsigned long head;
+  while ((head = r->head) != r->tail) {
+    size_t from = r->tail % r->size;
+    size_t len = head - r->tail;
+    struct iovec iov[2];
+    int cnt = 1;
+    iov[0].iov_base = r->buf + from;
+    iov[0].iov_len = len < r->size - from ? len : r->size - from;
+    if (iov[0].iov_len < len) { /* it wraps */
+      iov[1].iov_base = r->buf;
+      iov[1].iov_len = len - iov[0].iov_len;
+      cnt = 2;
+    }
+    ssize_t k = writev(r->fd, iov, cnt);
+    if (k < 0 && errno == EINTR) {
+      continue;
+    }
+    r->tail = k > 0 ? r->tail + k : head;
+  }
+  r->busy = 0;
+}
+
+/* out_write - Add n bytes of output from the main line, writing out
+ *    the ring first if they won't fit. Output too big for the ring
+ *    is written straight out after it.
+ */
+void out_write(const char* s, size_t n) {
+  if (n > OUT_RING - OUT_SLACK) {
+    out_flush();
+    while (n > 0) {
+      ssize_t k = write(STDOUT_FILENO, s, n);
+      if (k < 0 && errno == EINTR) {
+        continue;
+      }
+      if (k <= 0) {
+        return;
       }
-      printf("%s", jobs[i].cmdline);
+      s += k;
+      n -= k;
+    }
+    return;
+  }
+  while (1) {
+    outring.busy = 1;
+    int put = ring_put(&outring, s, n, OUT_RING - OUT_SLACK);
+    outring.busy = 0;
+    if (put) {
+      return;
+    }
+    out_flush();
+  }
+}
+
+/* out_flush - Write out the output ring. */
+void out_flush(void) {
+  ring_flush(&outring);
+}
+
+/*****************************
+ * Job event log (-L file)
+ *****************************/
+
+/*
+ * With -L, a JSON record is logged for each process a job starts
+ * (spawn), and when it stops, exits or is killed by a signal, and for
+ * each job that is continued or moved between foreground and
+ * background. Each record has the CLOCK_MONOTONIC time in ns, the
+ * pid, jid and pgid, the job's state after the event, the exit status
+ * or signal where there is one, and the command line, e.g.
+ *
+ *   {"t":81234,"event":"exit","pid":7,"jid":1,"pgid":7,"state":"bg",
+ *    "status":0,"cmdline":"./myspin 1 &"}
+ *
+ * one per line. Most events happen in the SIGCHLD handler, so records
+ * are formatted with sio_format and go into a ring like the output's,
+ * whose room is claimed in one step: logging one costs a few integer
+ * conversions and a memcpy. The ring is written to the file when the
+ * shell is between commands (in batch mode, once it is half full) and
+ * at exit, never during a command. If it fills up before then, records are
+ * dropped, and a "lost" record counts them.
+ */
+
+/* initevlog - Start logging job events to file. */
+void initevlog(const char* file) {
+  evlog.fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                  0644);
+  if (evlog.fd < 0) {
+    error((char*) file);
+  }
+  if (!(evlog.buf = malloc(EVLOG_RING))) {
+    error("initevlog: out of memory");
+  }
+  evlog.size = EVLOG_RING;
+}
+
+/* json_escape - Copy s into dst (of size cap) as the inside of a JSON
+ *    string, leaving off a final newline. Returns the length.
+ */
+static size_t json_escape(char* dst, size_t cap, const char* s) {
+  static const char hex[] = "0123456789abcdef";
+  size_t n = 0;
+  for (; s && *s && !(s[0] == '\n' && !s[1]) && n + 7 < cap; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      dst[n++] = '\\';
+      dst[n++] = c;
+    } else if (c < 0x20) {
+      memcpy(dst + n, "\\u00", 4);
+      dst[n + 4] = hex[c >> 4];
+      dst[n + 5] = hex[c & 15];
+      n += 6;
+    } else {
+      dst[n++] = c;
     }
   }
+  dst[n] = '\0';
+  return n;
+}
+
+/*
+ * evlog_job - Log an event of process pid (0: the job as a whole) of
+ *    job, with key, if not NULL, set to value. Async-signal-safe.
+ */
+void evlog_job(const char* event, job_t* job, pid_t pid, const char* key,
+               int value) {
+  static const char* states[] = { "done", "fg", "bg", "stopped", "queued",
+                                  "waiting" };
+  char cmdline[MAXLINE];
+  char rec[MAXLINE + 256];
+  int saved_errno = errno;
+
+  if (evlog.fd < 0) {
+    return;
+  }
+  json_escape(cmdline, sizeof(cmdline), job->cmdline);
+  size_t n = sio_format(rec, sizeof(rec), "{\"t\":%lld,\"event\":\"%s\","
+                        "\"pid\":%d,\"jid\":%d,\"pgid\":%d,\"state\":\"%s\"",
+                        now_ns(), event, pid ? pid : job->pid, job->jid,
+                        job->pgid, states[job->state]);
+  if (key) {
+    n += sio_format(rec + n, sizeof(rec) - n, ",\"%s\":%d", key, value);
+  }
+  n += sio_format(rec + n, sizeof(rec) - n, ",\"cmdline\":\"%s\"}\n",
+                  cmdline);
+  if (!ring_put(&evlog, rec, n, evlog.size)) {
+    __atomic_fetch_add(&evlog.lost, 1, __ATOMIC_SEQ_CST);
+  }
+  errno = saved_errno;
+}
+
+/* evlog_idle - The shell is between commands: write out the event
+ *    log, or in batch mode, only once the ring is half full.
+ */
+void evlog_idle(void) {
+  if (evlog.fd >= 0
+      && (!batch_mode || evlog.head - evlog.tail > evlog.size / 2)) {
+    ring_flush(&evlog);
+  }
 }
 
 /***********************
  * Other helper routines
  ***********************/
 
+/* sio_num - Write v in decimal, negated if neg, with leading zeros to
+ *    at least width digits, so that it ends at end. Returns where it
+ *    starts; end must have 22 bytes before it.
+ */
+static char* sio_num(char* end, unsigned long long v, int neg, int width) {
+  char* p = end;
+  *p = '\0';
+  width = width > 20 ? 20 : width;
+  do {
+    *--p = '0' + v % 10;
+    v /= 10;
+    width--;
+  } while (v || width > 0);
+  if (neg) {
+    *--p = '-';
+  }
+  return p;
+}
+
+/*
+ * sio_vformat - vsnprintf for signal handlers, which can't use stdio:
+ *    buf, of size cap, gets format with %d, %u, %s and %%, where a
+ *    number may be l or ll and have a zero-padded width, e.g. %03lld.
+ *    Returns the length.
+ */
+size_t sio_vformat(char* buf, size_t cap, const char* format, va_list args) {
+  size_t n = 0;
+  for (const char* f = format; *f && n + 1 < cap; f++) {
+    if (*f != '%') {
+      buf[n++] = *f;
+      continue;
+    }
+    int width = 0, longs = 0;
+    for (f++; *f >= '0' && *f <= '9'; f++) {
+      width = width * 10 + *f - '0';
+    }
+    for (; *f == 'l'; f++) {
+      longs++;
+    }
+    char num[24];
+    const char* s = num;
+    long long v;
+    switch (*f) {
+      case 'd':
+        v = longs > 1 ? va_arg(args, long long)
+          : longs ? va_arg(args, long) : va_arg(args, int);
+        s = sio_num(num + 23, v < 0 ? -(unsigned long long) v : v, v < 0,
+                    width);
+        break;
+      case 'u':
+        s = sio_num(num + 23, longs > 1 ? va_arg(args, unsigned long long)
+                    : longs ? va_arg(args, unsigned long)
+                    : va_arg(args, unsigned), 0, width);
+        break;
+      case 's':
+        s = va_arg(args, const char*);
+        break;
+      case '%':
+        s = "%";
+        break;
+      default: /* not ours: stop here */
+        buf[n] = '\0';
+        return n;
+    }
+    while (*s && n + 1 < cap) {
+      buf[n++] = *s++;
+    }
+  }
+  buf[n] = '\0';
+  return n;
+}
+
+/* sio_format - sio_vformat with the arguments given here. */
+size_t sio_format(char* buf, size_t cap, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  size_t n = sio_vformat(buf, cap, format, args);
+  va_end(args);
+  return n;
+}
+
 /* safe_printf – version of printf that's safe to use in signal handlers.
- *    Use this rather than printf itself inside signal handlers.
+ *    Use this rather than printf itself inside signal handlers. The
+ *    text goes into the output ring, and a handler writes it out, with
+ *    every signal blocked: one that came in between could write out
+ *    the room this claimed before the text is in it.
  */
 void safe_printf(const char* format, ...) {
   char buf[MAXLINE];
   va_list args;
+  sigset_t all, prev;
+  int saved_errno = errno;
 
   va_start(args, format);
-  vsnprintf(buf, sizeof(buf), format, args);
+  size_t len = sio_vformat(buf, sizeof(buf), format, args);
   va_end(args);
-  write(1, buf, strlen(buf)); /* write is async-signal-safe */
+  sigfillset(&all);
+  sigprocmask(SIG_BLOCK, &all, &prev);
+  if (!ring_put(&outring, buf, len, OUT_RING)) { /* full up */
+    write(STDOUT_FILENO, buf, len); /* write is async-signal-safe */
+  } else if (in_handler) {
+    out_flush();
+  }
+  sigprocmask(SIG_SETMASK, &prev, NULL);
+  errno = saved_errno;
+}
+
+/*
+ * relay - Copy what remains of fd from to fd to inside the kernel:
+ *    splice when either is a pipe, otherwise sendfile, and read and
+ *    write only where neither applies (e.g. a terminal on an older
+ *    kernel). Stops quietly at the first write error.
+ */
+void relay(int from, int to) {
+  char buf[8192];
+  ssize_t n;
+
+  while ((n = splice(from, NULL, to, NULL, 1 << 20, SPLICE_F_MOVE)) > 0
+         || (n < 0 && errno == EINTR)) {
+    ;
+  }
+  if (n < 0 && errno == EINVAL) { /* neither end is a pipe */
+    while ((n = sendfile(to, from, NULL, 1 << 20)) > 0
+           || (n < 0 && errno == EINTR)) {
+      ;
+    }
+  }
+  if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+    while ((n = read(from, buf, sizeof(buf))) > 0) {
+      if (write(to, buf, n) < 0) {
+        break;
+      }
+    }
+  }
 }
 
 /*
@@ -796,14 +7412,62 @@ handler_t* Signal(int signum, handler_t* handler) {
   return (old_action.sa_handler);
 }
 
+/*
+ * shell_atexit - Final reporting when the shell (not a child that
+ *    failed to exec) exits, after writing out the history and giving
+ *    back the jobserver tokens of jobs still running. Either way, the
+ *    output still in the ring is written.
+ */
+void shell_atexit(void) {
+  if (getpid() != shell_pid) {
+    out_flush();
+    return;
+  }
+  history_flush();
+  for (int jid = 1; jid <= jobs.maxjid; jid++) { /* jobs we leave running */
+    js_release(jobs.slots[jid - 1].token);
+  }
+  for (batch_t* b = batches; b; b = b->next_batch) {
+    for (int i = 0; i < b->nitems; i++) {
+      js_release(b->items[i].token);
+    }
+  }
+  if (verbose) {
+    print_stats();
+  }
+  if (evlog.fd >= 0) {
+    if (evlog.lost) {
+      char rec[64];
+      int n = snprintf(rec, sizeof(rec), "{\"t\":%lld,\"event\":\"lost\","
+                       "\"count\":%lu}\n", now_ns(), evlog.lost);
+      ring_flush(&evlog);
+      ring_put(&evlog, rec, n, evlog.size);
+    }
+    ring_flush(&evlog);
+  }
+  if (batch_mode && verbose) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double secs = (now.tv_sec - batch_start.tv_sec)
+        + (now.tv_nsec - batch_start.tv_nsec) / 1e9;
+    printf("Batch: %ld lines in %.3f s (%.0f lines/s)\n", batch_lines, secs,
+           secs > 0 ? batch_lines / secs : 0.0);
+  }
+  out_flush();
+}
+
 /*
  * print_usage - print a help message
  */
 void print_usage() {
-  printf("Usage: shell [-hvp]\n");
+  printf("Usage: shell [-hvpFe] [-f script] [-L file]\n");
   printf("   -h   print this message\n");
   printf("   -v   print additional diagnostic information\n");
   printf("   -p   do not emit a command prompt\n");
+  printf("   -F   launch jobs with fork+execve instead of posix_spawn\n");
+  printf("   -e   use the event-driven core (signalfd, pidfd, epoll)\n");
+  printf("   -f   run the commands in a script file in batch mode\n");
+  printf("   -L   log job events to a file, one JSON record per line\n");
   exit(1);
 }
 
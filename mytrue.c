@@ -0,0 +1,22 @@
+/* 
+ * mytrue.c - A handy program for measuring your shell
+ * 
+ * usage: mytrue [tag]
+ * Exits immediately. Given a tag, first writes it on a line of its
+ * own, so a driver can tell when the command ran.
+ *
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+int main(int argc, char** argv) {
+  if (argc > 2) {
+    fprintf(stderr, "Usage: %s [tag]\n", argv[0]);
+    exit(0);
+  }
+  if (argc == 2) {
+    printf("%s\n", argv[1]);
+  }
+  exit(0);
+}
@@ -0,0 +1,109 @@
+/*
+ * parsebench.c - Microbenchmark for the shell's command-line tokenizer
+ *
+ * usage: parsebench [iterations]
+ * Times tokenize against the fixed-size parseline it replaced, on a
+ * few kinds of command line, and prints one key=value line for each.
+ * Only lines the old parser handles correctly are used: under 1024
+ * bytes, fewer than 128 words, no quotes.
+ *
+ */
+#define main bsh_main
+#include "bsh.c"
+#undef main
+
+#define OLD_MAXARGS 128
+
+/* parseline_old - The original parser: a static copy, strchr passes. */
+int parseline_old(const char* cmdline, char** argv) {
+  static char array[MAXLINE]; /* holds local copy of command line */
+  char* buf = array;          /* ptr that traverses command line */
+  char* delim;                /* points to first space delimiter */
+  int argc;                   /* number of args */
+  int bg;                     /* background job? */
+
+  strcpy(buf, cmdline);
+  buf[strlen(buf) - 1] = ' ';  /* replace trailing '\n' with space */
+  while (*buf && (*buf == ' ')) { /* ignore leading spaces */
+    buf++;
+  }
+
+  /* Build the argv list */
+  argc = 0;
+  if (*buf == '\'') {
+    buf++;
+    delim = strchr(buf, '\'');
+  } else {
+    delim = strchr(buf, ' ');
+  }
+
+  while (delim) {
+    argv[argc++] = buf;
+    *delim = '\0';
+    buf = delim + 1;
+    while (*buf && (*buf == ' ')) { /* ignore spaces */
+      buf++;
+    }
+
+    if (*buf == '\'') {
+      buf++;
+      delim = strchr(buf, '\'');
+    } else {
+      delim = strchr(buf, ' ');
+    }
+  }
+  argv[argc] = NULL;
+
+  if (argc == 0) {  /* ignore blank line */
+    return 1;
+  }
+
+  /* should the job run in the background? */
+  if ((bg = (*argv[argc-1] == '&')) != 0) {
+    argv[--argc] = NULL;
+  }
+  return bg;
+}
+
+int main(int argc, char** argv) {
+  long iters = argc > 1 ? atol(argv[1]) : 1000000;
+  static char args[MAXLINE];
+  static char* oldargv[OLD_MAXARGS];
+  arena_t arena = { NULL, 0, NULL, 0 };
+  int bg;
+  long sink = 0;
+
+  /* a long line: 100 file names */
+  int len = snprintf(args, sizeof(args), "/bin/ls");
+  for (int i = 0; i < 100; i++) {
+    len += snprintf(args + len, sizeof(args) - len, " f%03d.c", i);
+  }
+  snprintf(args + len, sizeof(args) - len, "\n");
+
+  const char* names[] = { "short", "medium", "long" };
+  const char* lines[] = {
+    "./myspin 1 &\n",
+    "  /usr/bin/gcc -Wall -O2 -g -c -o build/job.o src/job.c   \n",
+    args
+  };
+
+  for (int k = 0; k < 3; k++) {
+    long long start = now_ns();
+    for (long i = 0; i < iters; i++) {
+      sink += parseline_old(lines[k], oldargv);
+    }
+    long long old_ns = now_ns() - start;
+
+    start = now_ns();
+    for (long i = 0; i < iters; i++) {
+      sink += tokenize(lines[k], &arena, &bg);
+    }
+    long long new_ns = now_ns() - start;
+
+    printf("bench=parse line=%s bytes=%zu iters=%ld parseline_ns=%.1f "
+           "tokenize_ns=%.1f speedup=%.2f\n", names[k], strlen(lines[k]),
+           iters, (double)old_ns / iters, (double)new_ns / iters,
+           (double)old_ns / new_ns);
+  }
+  return sink == 42; /* keep the loops from being optimized away */
+}
@@ -0,0 +1,243 @@
+#!/usr/bin/perl
+use Getopt::Std;
+use FileHandle;
+use POSIX ":sys_wait_h";
+use Time::HiRes qw(time usleep);
+
+#######################################################################
+# sbench.pl - Shell benchmark driver
+#
+# The driver runs a shell program as a child, connected by pipes the
+# same way sdriver.pl connects it, and times synthetic workloads:
+#
+#     seq     <n> foreground commands, one after another
+#     bg      <n> background jobs, at most <c> of them outstanding
+#     int     <r> foreground jobs, each killed with a SIGINT
+#     tstp    <r> foreground jobs, each stopped with a SIGTSTP
+#
+# Commands run ./mytrue, which writes a tag and exits, so the driver
+# sees each one finish. Each workload prints one line of key=value
+# pairs: commands (or signals) per second, and the p50 and p99 of the
+# time from writing the command (or sending the signal) until the
+# driver saw its effect.
+######################################################################
+
+#
+# usage - print help message and terminate
+#
+sub usage {
+    printf STDERR "$_[0]\n";
+    printf STDERR "Usage: $0 [-hv] -s <shellprog> -a <args> [-n <n>] [-c <c>] [-r <r>] [-w <list>]\n";
+    printf STDERR "Options:\n";
+    printf STDERR "  -h            Print this message\n";
+    printf STDERR "  -v            Be more verbose\n";
+    printf STDERR "  -s <shell>    Shell program to benchmark\n";
+    printf STDERR "  -a <args>     Shell arguments\n";
+    printf STDERR "  -n <n>        Commands in the seq and bg workloads (10000)\n";
+    printf STDERR "  -c <c>        Background jobs outstanding at once (8)\n";
+    printf STDERR "  -r <r>        Signals in the int and tstp workloads (1000)\n";
+    printf STDERR "  -w <list>     Comma-separated workloads (seq,bg,int,tstp)\n";
+    die "\n" ;
+}
+
+# Parse the command line arguments
+getopts('hvs:a:n:c:r:w:');
+if ($opt_h) {
+    usage();
+}
+if (!$opt_s) {
+    usage("Missing required -s argument");
+}
+$verbose = $opt_v;
+$shellprog = $opt_s;
+$shellargs = $opt_a;
+$count = $opt_n || 10000;
+$conc = $opt_c || 8;
+$storms = $opt_r || 1000;
+@workloads = split /,/, ($opt_w || "seq,bg,int,tstp");
+
+# Make sure the shell program and the helper exist and are executable
+-x $shellprog
+    or die "$0: ERROR: $shellprog not found or not executable\n";
+-x "./mytrue"
+    or die "$0: ERROR: ./mytrue not found; run make first\n";
+
+$timeout = 0.2;   # resend a signal the shell has not acted on by then
+$SIG{PIPE} = 'IGNORE';   # a shell that dies is reported, not fatal
+
+#
+# start_shell - Fork a child running the shell, connected by a pair of
+#     unidirectional pipes as in sdriver.pl. The shell gets a process
+#     group of its own, so no signal it sends can reach the driver.
+#
+sub start_shell {
+    pipe(ChildIn, Writer) or die "$0: ERROR: pipe: $!\n";
+    pipe(Reader, ChildOut) or die "$0: ERROR: pipe: $!\n";
+    $pid = fork();
+    defined $pid or die "$0: ERROR: fork: $!\n";
+    if ($pid == 0) {
+	POSIX::setpgid(0, 0);
+	open(STDIN, "<&ChildIn");
+	open(STDOUT, ">&ChildOut");
+	close Writer;
+	close Reader;
+	exec("$shellprog $shellargs") or POSIX::_exit(1);
+    }
+    close ChildIn;
+    close ChildOut;
+    Writer->autoflush();
+    $inbuf = "";
+}
+
+#
+# stop_shell - Tell the shell to quit and reap it.
+#
+sub stop_shell {
+    print Writer "quit\n";
+    close Writer;
+    close Reader;
+    waitpid($pid, 0);
+}
+
+#
+# readline_timeout - Return the next line of shell output without its
+#     newline, or undef if none arrives within the given seconds.
+#
+sub readline_timeout {
+    my ($secs) = @_;
+    my $deadline = time() + $secs;
+    while ($inbuf !~ /\n/) {
+	my $left = $deadline - time();
+	return undef if $left <= 0;
+	my $rin = "";
+	vec($rin, fileno(Reader), 1) = 1;
+	next unless select($rin, undef, undef, $left) > 0;
+	my $n = sysread(Reader, $inbuf, 65536, length($inbuf));
+	die "$0: ERROR: $shellprog exited\n" unless $n;
+    }
+    $inbuf =~ s/^(.*)\n//;
+    print "$0: got :$1:\n" if $verbose;
+    return $1;
+}
+
+#
+# wait_for - Read shell output until a line matches the pattern, and
+#     return the match. Dies if the shell goes quiet for 10 seconds.
+#
+sub wait_for {
+    my ($pattern) = @_;
+    while (1) {
+	my $line = readline_timeout(10);
+	defined $line
+	    or die "$0: ERROR: $shellprog stopped responding\n";
+	return $line if $line =~ $pattern;
+    }
+}
+
+#
+# report - Print one machine-readable result line.
+#
+sub report {
+    my ($name, $n, $secs, @lat) = @_;
+    @lat = sort { $a <=> $b } @lat;
+    my $p50 = $lat[int(0.50 * $#lat)] * 1e6;
+    my $p99 = $lat[int(0.99 * $#lat)] * 1e6;
+    printf("bench=%s shell=%s n=%d secs=%.3f ops_per_sec=%.0f p50_us=%.0f p99_us=%.0f\n",
+	   $name, $shellprog, $n, $secs, $n / $secs, $p50, $p99);
+}
+
+#
+# bench_seq - Foreground commands, each written once the last finished.
+#
+sub bench_seq {
+    my @lat;
+    my $start = time();
+    for my $i (1 .. $count) {
+	my $t = time();
+	print Writer "./mytrue s$i\n";
+	wait_for(qr/^s$i$/);
+	push @lat, time() - $t;
+    }
+    report("seq", $count, time() - $start, @lat);
+}
+
+#
+# bench_bg - Background jobs, keeping $conc of them outstanding.
+#
+sub bench_bg {
+    my (@lat, %sent);
+    my ($next, $done) = (1, 0);
+    my $start = time();
+    while ($done < $count) {
+	while ($next <= $count && $next - $done <= $conc) {
+	    $sent{$next} = time();
+	    print Writer "./mytrue b$next &\n";
+	    $next++;
+	}
+	my $line = wait_for(qr/^b\d+$/);
+	$line =~ /^b(\d+)$/;
+	push @lat, time() - delete $sent{$1};
+	$done++;
+    }
+    report("bg", $count, time() - $start, @lat);
+}
+
+#
+# bench_signal - Start a long foreground job and signal the shell until
+#     it reports the job stopped or terminated. Stopped jobs are then
+#     killed, and the driver waits until the shell has reaped them.
+#
+sub bench_signal {
+    my ($name, $sig, $pattern) = @_;
+    my @lat;
+    my $start = time();
+    for my $i (1 .. $storms) {
+	print Writer "./mytrue r$i\n./myspin 10\n";
+	wait_for(qr/^r$i$/);
+	usleep(1000);   # let the shell read the next line and launch it
+	my ($t, $line);
+	do {
+	    $t = time();
+	    kill $sig, $pid;
+	    do {
+		$line = readline_timeout($timeout);
+	    } while (defined $line && $line !~ $pattern);
+	} until (defined $line);
+	push @lat, time() - $t;
+	if ($sig eq 'TSTP') {
+	    $line =~ /\((\d+)\)/;
+	    kill 'KILL', $1;
+	    wait_for(qr/terminated by signal/);
+	}
+    }
+    report($name, $storms, time() - $start, @lat);
+}
+
+#
+# Run each workload against a fresh shell. A shell that dies or hangs
+# gets an error result for that workload, and the rest still run.
+#
+for my $w (@workloads) {
+    $w =~ /^(seq|bg|int|tstp)$/
+	or usage("Unknown workload $w");
+    start_shell();
+    eval {
+	if ($w eq "seq") {
+	    bench_seq();
+	} elsif ($w eq "bg") {
+	    bench_bg();
+	} elsif ($w eq "int") {
+	    bench_signal("int", 'INT', qr/terminated by signal/);
+	} else {
+	    bench_signal("tstp", 'TSTP', qr/stopped by signal/);
+	}
+    };
+    if ($@) {
+	(my $err = $@) =~ s/^.*ERROR: (.*)\n$/$1/s;
+	printf("bench=%s shell=%s error=\"%s\"\n", $w, $shellprog, $err);
+	kill 'KILL', $pid;
+    }
+    stop_shell();
+}
+
+exit;
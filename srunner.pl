@@ -0,0 +1,224 @@
+#!/usr/bin/perl
+use Getopt::Std;
+use POSIX ":sys_wait_h";
+use File::Temp qw(tempdir);
+use Time::HiRes qw(time usleep);
+
+#######################################################################
+# srunner.pl - Concurrent trace runner
+#
+# The runner starts sdriver.pl on every trace for both the shell under
+# test and the reference shell, all at once, so a full pass takes about
+# as long as the slowest trace. Each driver runs in a session of its
+# own: it has no controlling terminal, and its processes are a group
+# the runner can kill if the trace hangs. When all are done the runner
+# normalizes the outputs, diffs each trace against the reference, and
+# exits 0 only if every trace matches.
+#
+# A trace with a traceNN.expect file next to it tests something the
+# reference shell doesn't have: it runs on the shell under test only,
+# and its output is diffed against the expect file. -u rewrites the
+# expect files from the shell under test; a new trace needs an empty
+# one to start. Such a trace may ask for more arguments for the shell
+# under test with a "# args: ..." line.
+#
+# Normalization replaces pids, whether "(pid)" in job lines, bare after
+# a job id, or in a JSON record, along with the times and pgids in JSON
+# records, and reduces ps listings to the STAT and COMMAND of the test
+# programs.
+#
+# Each shell gets a fresh history file of its own, in BSH_HISTORY, so
+# a trace sees only its own lines and never touches ~/.bsh_history.
+######################################################################
+
+#
+# usage - print help message and terminate
+#
+sub usage {
+    printf STDERR "$_[0]\n";
+    printf STDERR "Usage: $0 [-hv] -s <shellprog> -r <refprog> -a <args> [-A <args>] [-k <dir>] [-T <secs>] [-u] [trace ...]\n";
+    printf STDERR "Options:\n";
+    printf STDERR "  -h            Print this message\n";
+    printf STDERR "  -v            Print the diff of each trace that does not match\n";
+    printf STDERR "  -s <shell>    Shell program to test\n";
+    printf STDERR "  -r <ref>      Reference shell program\n";
+    printf STDERR "  -a <args>     Shell arguments\n";
+    printf STDERR "  -A <args>     More arguments for the shell under test only\n";
+    printf STDERR "  -k <dir>      Keep the raw and normalized outputs in dir\n";
+    printf STDERR "  -T <secs>     Kill a trace still running after secs (60)\n";
+    printf STDERR "  -u            Rewrite the expect files from the shell under test\n";
+    printf STDERR "With no traces given, runs every trace*.txt\n";
+    die "\n" ;
+}
+
+# Parse the command line arguments
+getopts('hvus:r:a:A:k:T:');
+if ($opt_h) {
+    usage();
+}
+if (!$opt_s) {
+    usage("Missing required -s argument");
+}
+if (!$opt_r) {
+    usage("Missing required -r argument");
+}
+$verbose = $opt_v;
+$shellargs = $opt_a;
+$testargs = $opt_A ? "$opt_a $opt_A" : $opt_a;
+$limit = $opt_T || 60;
+@traces = @ARGV ? @ARGV : sort glob("trace*.txt");
+@traces or usage("No traces to run");
+@shells = ($opt_s, $opt_r);
+
+for my $prog (@shells) {
+    -x $prog
+	or die "$0: ERROR: $prog not found or not executable\n";
+}
+
+if ($opt_k) {
+    $outdir = $opt_k;
+    -d $outdir or mkdir $outdir
+	or die "$0: ERROR: Couldn't create $outdir: $!\n";
+} else {
+    $outdir = tempdir("srunner.XXXXXX", TMPDIR => 1, CLEANUP => 1);
+}
+
+# outfile - Where the output of one shell on one trace is kept.
+sub outfile {
+    my ($prog, $trace, $suffix) = @_;
+    (my $name = "$prog.$trace") =~ s{^\./}{};
+    $name =~ s{[/.]}{_}g;
+    return "$outdir/$name.$suffix";
+}
+
+# traceargs - The arguments a trace's "# args:" line asks for, if any.
+sub traceargs {
+    my ($trace) = @_;
+    open(my $fh, "<", $trace) or return "";
+    while (my $line = <$fh>) {
+	return $1 if $line =~ /^#\s*args:\s*(.*?)\s*$/;
+    }
+    return "";
+}
+
+#
+# start - Run sdriver.pl on a trace in a new session, with its output
+#     in a file. Returns the driver's pid, which is also its pgid.
+#
+sub start {
+    my ($prog, $trace) = @_;
+    my $out = outfile($prog, $trace, "out");
+    my $args = $prog eq $opt_s ? $testargs : $shellargs;
+    if ($prog eq $opt_s && (my $more = traceargs($trace))) {
+	$args = "$args $more";
+    }
+    my $pid = fork();
+    defined $pid or die "$0: ERROR: fork: $!\n";
+    if ($pid == 0) {
+	POSIX::setsid();
+	my $history = outfile($prog, $trace, "history");
+	unlink($history);
+	$ENV{BSH_HISTORY} = $history;
+	open(STDIN, "</dev/null");
+	open(STDOUT, ">$out") or POSIX::_exit(1);
+	open(STDERR, ">&STDOUT");
+	exec("./sdriver.pl", "-t", $trace, "-s", $prog, "-a", $args)
+	    or POSIX::_exit(1);
+    }
+    return $pid;
+}
+
+#
+# normalize - Copy an output file, replacing what differs run to run.
+#
+sub normalize {
+    my ($in, $out) = @_;
+    open(IN, "<$in") or die "$0: ERROR: Couldn't open $in: $!\n";
+    open(OUT, ">$out") or die "$0: ERROR: Couldn't create $out: $!\n";
+    while (my $line = <IN>) {
+	# ps u: USER PID %CPU %MEM VSZ RSS TTY STAT START TIME COMMAND
+	if ($line =~ /^\S+\s+\d+\s+[\d.]+\s+[\d.]+\s+\d+\s+\d+\s+\S+\s+(\S+)\s+\S+\s+\S+\s+(.*)$/) {
+	    my ($stat, $cmd) = ($1, $2);
+	    next unless $cmd =~ m{^\./my};   # the driver, the shell, ps
+	    $line = "$stat $cmd\n";
+	}
+	$line =~ s/\(\d+\)/(PID)/g;
+	$line =~ s/^(\[\d+\]) \d+ /$1 PID /;
+	$line =~ s/"pid":\d+/"pid":PID/g;
+	$line =~ s/"pgid":\d+/"pgid":PID/g;
+	$line =~ s/"t":\d+/"t":T/g;
+	print OUT $line;
+    }
+    close IN;
+    close OUT;
+}
+
+#
+# expectfile - The saved output of a trace the reference can't run, or
+#     undef if the trace has none.
+#
+sub expectfile {
+    (my $expect = $_[0]) =~ s/\.txt$/.expect/;
+    return -e $expect && $expect ne $_[0] ? $expect : undef;
+}
+
+#
+# Start everything, then reap drivers as they finish, killing any
+# that outlive the time limit.
+#
+%running = ();
+for my $trace (@traces) {
+    -r $trace or die "$0: ERROR: $trace not found\n";
+    for my $prog (expectfile($trace) ? ($opt_s) : @shells) {
+	$running{start($prog, $trace)} = "$prog $trace";
+    }
+}
+
+$start = time();
+while (%running) {
+    my $pid = waitpid(-1, WNOHANG);
+    if ($pid > 0) {
+	delete $running{$pid};
+	next;
+    }
+    if (time() - $start > $limit) {
+	for my $pid (keys %running) {
+	    print "$0: Killing $running{$pid}, still running after $limit secs\n";
+	    kill 'KILL', -$pid;
+	    waitpid($pid, 0);
+	}
+	last;
+    }
+    usleep(20000);
+}
+
+#
+# Compare each trace's normalized output against the reference's, or
+# against its expect file.
+#
+$failed = 0;
+for my $trace (@traces) {
+    my $expect = expectfile($trace);
+    my $mine = outfile($opt_s, $trace, "norm");
+    my $ref = $expect || outfile($opt_r, $trace, "norm");
+    normalize(outfile($opt_s, $trace, "out"), $mine);
+    if ($expect && $opt_u) {
+	system("cp", $mine, $expect) == 0
+	    or die "$0: ERROR: Couldn't write $expect\n";
+	print "$trace: wrote $expect\n";
+	next;
+    }
+    $expect or normalize(outfile($opt_r, $trace, "out"), $ref);
+    my $diff = `diff -u $ref $mine`;
+    if ($? == 0) {
+	print "$trace: ok\n";
+    } else {
+	print "$trace: DIFF\n";
+	print $diff if $verbose;
+	$failed++;
+    }
+}
+
+printf("%d of %d traces match %s in %.1f secs\n",
+       @traces - $failed, scalar @traces, $opt_r, time() - $start);
+exit($failed ? 1 : 0);